@@ -0,0 +1,164 @@
+/*
+ * checksumbench.cpp
+ *
+ * Measures what checking cached data against its CRC32C costs: the raw
+ * speed of each checksum kernel, a memory cache hit with and without
+ * verify_pages, from one thread and from several at once, and a small file
+ * read back from a disk slab, which is always checked. Slab reads are timed
+ * twice: served from the OS page cache, and from the device, by dropping
+ * the slab file from the page cache before every read.
+ *
+ * usage: checksumbench [slab file]
+ *
+ * The slab file should be on the device to measure, not on tmpfs.
+ */
+
+#include <fuse_lowlevel.h>
+#include "checksum.h"
+#include "pagecache.h"
+#include "slabstore.h"
+#include "stats.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace fusecache;
+
+typedef std::chrono::steady_clock clock_type;
+
+static const size_t page_size = 64 * 1024;
+
+//------------------------------------------------------------------------------
+//! @return seconds since start
+//------------------------------------------------------------------------------
+static double since( clock_type::time_point start )
+{
+  return std::chrono::duration<double>( clock_type::now() - start ).count();
+}
+
+//------------------------------------------------------------------------------
+//! Checksum one page over and over with a kernel
+//------------------------------------------------------------------------------
+static void bench_kernel( const char         *name,
+                          checksum::kernel_t  kernel,
+                          const std::string  &page )
+{
+  const int              iters = 20000;
+  uint32_t               crc   = 0;
+  clock_type::time_point start = clock_type::now();
+
+  for( int i = 0; i < iters; ++i )
+    crc += kernel( ~0u, page.data(), page.size() );
+
+  double secs = since( start );
+  printf( "%-12s %8.2f GB/s (%08x)\n", name,
+          iters * page.size() / secs / 1e9, crc );
+}
+
+//------------------------------------------------------------------------------
+//! Time hits and insertions of a memory cache. The hits are shared out
+//! between threads, so that the time per hit shows how well they scale.
+//------------------------------------------------------------------------------
+static void bench_cache( stats *verify, const std::string &page, int threads )
+{
+  const int  pages = 256, hits = 200000, puts = 20000;
+  page_cache cache( page_size, pages );
+  cache.configure( page_size, pages, clock_type::duration::zero(), verify );
+  for( int i = 0; i < pages; ++i ) cache.put( 1, i, page );
+
+  std::vector<std::thread> readers;
+  clock_type::time_point   start = clock_type::now();
+  for( int t = 0; t < threads; ++t )
+    readers.push_back( std::thread( [&cache, t, threads]
+    {
+      std::string out;
+      bool        stale;
+      for( int i = t; i < hits; i += threads )
+        cache.get( 1, i % pages, out, stale );
+    } ) );
+  for( int t = 0; t < threads; ++t ) readers[t].join();
+  double get = since( start );
+
+  start = clock_type::now();
+  for( int i = 0; i < puts; ++i ) cache.put( 1, i % pages, page );
+  double put = since( start );
+
+  printf( "page hit, verify_pages %-4s %d thread%s %6.2f us/hit, "
+          "%6.2f us/put\n", verify ? "on," : "off,", threads,
+          threads > 1 ? "s:" : ": ", get / hits * 1e6, put / puts * 1e6 );
+}
+
+//------------------------------------------------------------------------------
+//! Time reads of small files which have to come back from a disk slab
+//!
+//! @param cold drop the slab file from the page cache before every read, so
+//!             that it is read from the device
+//------------------------------------------------------------------------------
+static int bench_slabs( const std::string &path,
+                        const std::string &page,
+                        bool               cold )
+{
+  stats      counters;
+  slab_store slabs;
+  int ret = slabs.configure( 1024 * 1024, 1, 64, std::chrono::seconds( 0 ),
+                             path, &counters );
+  int fd  = ::open( path.c_str(), O_RDONLY );
+  if( ret < 0 || fd < 0 )
+  {
+    fprintf( stderr, "cannot open slab file %s\n", path.c_str() );
+    if( fd >= 0 ) ::close( fd );
+    return 1;
+  }
+
+  const int   files = 1000, reads = cold ? 2000 : 100000;
+  std::string file  = page.substr( 0, 16 * 1024 );
+  for( int i = 0; i < files; ++i ) slabs.put( i, file );
+  ::fdatasync( fd );
+
+  std::string out;
+  bool        stale;
+  double      secs = 0;
+  uint64_t    nsec = counters.verify_nsec;
+  for( int i = 0; i < reads; ++i )
+  {
+    if( cold ) ::posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+    clock_type::time_point start = clock_type::now();
+    slabs.get( i % ( files - 100 ), out, stale );
+    secs += since( start );
+  }
+  double verify = ( counters.verify_nsec - nsec ) / 1e9;
+
+  printf( "16K slab read, %s %7.2f us/read, %6.2f us verifying "
+          "(%.1f%%)\n", cold ? "device:    " : "page cache:",
+          secs / reads * 1e6, verify / reads * 1e6, 100 * verify / secs );
+  ::close( fd );
+  remove( path.c_str() );
+  return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+  std::string page( page_size, '\0' );
+  for( size_t i = 0; i < page.size(); ++i )
+    page[i] = (char) ( i * 2654435761u >> 13 );
+
+  const char *name;
+  checksum::kernel_t kernel = checksum::select( &name );
+  bench_kernel( "software", checksum::software, page );
+  if( kernel != checksum::software ) bench_kernel( name, kernel, page );
+
+  int threads = std::max( 2u, std::thread::hardware_concurrency() / 2 );
+  stats counters;
+  bench_cache( 0, page, 1 );
+  bench_cache( &counters, page, 1 );
+  bench_cache( 0, page, threads );
+  bench_cache( &counters, page, threads );
+
+  std::string path = argc > 1 ? argv[1] : "/var/tmp/checksumbench.slabs";
+  return bench_slabs( path, page, false ) || bench_slabs( path, page, true );
+}
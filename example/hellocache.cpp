@@ -11,6 +11,8 @@
 #include <cerrno>
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
+#include <sstream>
 
 static const char *hello_str  = "Hello World!\n";
 static const char *hello_name = "hello";
@@ -131,7 +133,7 @@ class hellocache : public fusecache::fs<hellocache>
         e.entry_timeout = 1.0;
         hello_stat( e.ino, &e.attr );
 
-        fuse_reply_entry( req, &e );
+        reply_entry( req, &e );
       }
     }
 
@@ -291,7 +293,7 @@ class hellocache : public fusecache::fs<hellocache>
       else if( ( fi->flags & 3 ) != O_RDONLY )
         fuse_reply_err( req, EACCES );
       else
-        fuse_reply_open( req, fi );
+        reply_open( req, ino, fi );
     }
 
     //--------------------------------------------------------------------------
@@ -322,12 +324,26 @@ class hellocache : public fusecache::fs<hellocache>
       reply_buf_limited( req, hello_str, strlen( hello_str ), off, size );
     }
 
+    //--------------------------------------------------------------------------
+    //! Backend read used by the cache layer
+    //--------------------------------------------------------------------------
     int read( fuse_ino_t ino, size_t size, off_t off, std::string &buf )
     {
-      buf = "trololol\n";
+      std::cout << "hello backend read()" << std::endl;
+      std::string content( "trololol\n" );
+      buf = off < (off_t) content.size() ? content.substr( off, size ) : "";
       return 0;
     }
 
+    //--------------------------------------------------------------------------
+    //! Backend write used to upload changes made while offline. Hello world
+    //! is read only.
+    //--------------------------------------------------------------------------
+    int write( fuse_ino_t ino, const std::string &buf, off_t off )
+    {
+      return -EROFS;
+    }
+
     //--------------------------------------------------------------------------
     //! Write function
     //--------------------------------------------------------------------------
@@ -371,6 +387,19 @@ class hellocache : public fusecache::fs<hellocache>
       std::cout << "hello forget()" << std::endl;
     }
 
+#if FUSE_VERSION >= 29
+    //--------------------------------------------------------------------------
+    //! Forget several inodes at once
+    //--------------------------------------------------------------------------
+    static void forget_multi( fuse_req_t               req,
+                              size_t                   count,
+                              struct fuse_forget_data *forgets )
+    {
+      std::cout << "hello forget_multi()" << std::endl;
+      fuse_reply_none( req );
+    }
+#endif
+
     //--------------------------------------------------------------------------
     //! Called on each close so that the filesystem has a chance to report delayed errors
     //! Important: there may be more than one flush call for each open.
@@ -432,6 +461,20 @@ int main( int argc, char *argv[] )
 {
   hellocache fs;
 
+  //----------------------------------------------------------------------------
+  //! Share pages with other daemons, which may all run on one host, e.g.
+  //! FUSECACHE_PEERS=127.0.0.1:7001,127.0.0.1:7002 FUSECACHE_PEER_SELF=0
+  //----------------------------------------------------------------------------
+  if( const char *peers = getenv( "FUSECACHE_PEERS" ) )
+  {
+    std::istringstream in( peers );
+    std::string        peer;
+    while( std::getline( in, peer, ',' ) )
+      if( !peer.empty() ) fs.cfg.peers.push_back( peer );
+  }
+  if( const char *self = getenv( "FUSECACHE_PEER_SELF" ) )
+    fs.cfg.peer_self = atoi( self );
+
   //----------------------------------------------------------------------------
   //! Runs the daemon at the mountpoint specified in argv and with other
   //! options if specified
@@ -0,0 +1,52 @@
+#!/bin/sh
+#-------------------------------------------------------------------------------
+# Runs several hellocache daemons on this host, reads the same file through
+# every mount and counts how often the backend was asked for it: once with
+# each daemon on its own, and once with the daemons sharing pages over
+# loopback, where only the owner of the page should go to the backend.
+#
+# usage: peers.sh <hellocache binary> [daemons] [first port]
+#-------------------------------------------------------------------------------
+
+bin=${1:?usage: $0 <hellocache binary> [daemons] [first port]}
+n=${2:-3}
+port=${3:-7100}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+run()
+{
+  peers=
+  if [ "$1" = shared ]; then
+    for i in $(seq 0 $((n - 1))); do
+      peers="$peers${peers:+,}127.0.0.1:$((port + i))"
+    done
+  fi
+
+  for i in $(seq 0 $((n - 1))); do
+    mkdir -p "$dir/mnt$i"
+    FUSECACHE_PEERS=$peers FUSECACHE_PEER_SELF=$i \
+      "$bin" -f "$dir/mnt$i" > "$dir/$1.$i.log" 2>&1 &
+  done
+
+  for i in $(seq 0 $((n - 1))); do
+    tries=0
+    until [ -e "$dir/mnt$i/hello" ] || [ $tries -ge 50 ]; do
+      sleep 0.1
+      tries=$((tries + 1))
+    done
+    cat "$dir/mnt$i/hello" > /dev/null
+  done
+
+  for i in $(seq 0 $((n - 1))); do
+    fusermount -u "$dir/mnt$i"
+  done
+  wait
+
+  echo "$1: $(cat "$dir/$1".*.log | grep -c 'hello backend read()')" \
+       "backend reads for $n daemons"
+  grep -h '^peers:' "$dir/$1".*.log
+}
+
+run alone
+run shared
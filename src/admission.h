@@ -0,0 +1,153 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2012-2013 by European Organization for Nuclear Research (CERN)
+// Author: Justin Salmon <jsalmon@cern.ch>
+//------------------------------------------------------------------------------
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with This program.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#ifndef __FUSECACHE_ADMISSION_HPP__
+#define __FUSECACHE_ADMISSION_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+namespace fusecache
+{
+  //----------------------------------------------------------------------------
+  //! Which pages are allowed into the cache
+  //----------------------------------------------------------------------------
+  enum admission_t
+  {
+    ADMIT_ALL,           //!< every page fetched is cached
+    ADMIT_SECOND_ACCESS, //!< pages are cached once they are read a second time
+    ADMIT_TINYLFU        //!< pages are cached if they are read more often
+                         //!< than the page they would evict
+  };
+
+  //----------------------------------------------------------------------------
+  //! Count-min sketch of recent page access frequencies, as used by TinyLFU.
+  //!
+  //! Four rows of 4-bit saturating counters are packed sixteen to a word and
+  //! updated with compare-and-swap, so recording an access never takes a
+  //! lock. Each row has sixteen counters per cached item, which comes to 32
+  //! bytes per item in all. Once as many accesses as ten times the cache size
+  //! have been recorded every counter is halved, so that old popularity
+  //! fades.
+  //----------------------------------------------------------------------------
+  class frequency_sketch
+  {
+    public:
+      //------------------------------------------------------------------------
+      //! Constructor
+      //------------------------------------------------------------------------
+      frequency_sketch() : mask( 0 ), window( 0 ), samples( 0 ) {};
+
+      //------------------------------------------------------------------------
+      //! Size the sketch. Not safe to call while it is in use.
+      //!
+      //! @param items number of items the cache can hold
+      //------------------------------------------------------------------------
+      void configure( size_t items )
+      {
+        size_t width = 64;
+        while( width < items * 16 ) width <<= 1;
+
+        words.reset( new std::atomic<uint64_t>[rows * width / 16] );
+        for( size_t i = 0; i < rows * width / 16; ++i ) words[i] = 0;
+        mask    = width - 1;
+        window  = std::max<size_t>( 1, items * 10 );
+        samples = 0;
+      }
+
+      //------------------------------------------------------------------------
+      //! Count one access to an item
+      //------------------------------------------------------------------------
+      void increment( uint64_t hash )
+      {
+        if( !words ) return;
+
+        for( size_t row = 0; row < rows; ++row )
+        {
+          size_t                 counter = index( hash, row );
+          std::atomic<uint64_t> &word    = words[counter / 16];
+          int                    shift   = ( counter % 16 ) * 4;
+          uint64_t               old     = word.load();
+
+          while( ( ( old >> shift ) & 0xf ) != 0xf &&
+                 !word.compare_exchange_weak( old, old + ( 1ULL << shift ),
+                                              std::memory_order_relaxed ) );
+        }
+
+        if( samples.fetch_add( 1, std::memory_order_relaxed ) + 1 == window )
+          age();
+      }
+
+      //------------------------------------------------------------------------
+      //! @return estimated number of recent accesses to an item
+      //------------------------------------------------------------------------
+      unsigned estimate( uint64_t hash ) const
+      {
+        if( !words ) return 0;
+
+        unsigned min = 0xf;
+        for( size_t row = 0; row < rows; ++row )
+        {
+          size_t   counter = index( hash, row );
+          uint64_t word    = words[counter / 16].load();
+          min = std::min<unsigned>( min, word >> ( counter % 16 ) * 4 & 0xf );
+        }
+        return min;
+      }
+
+    private:
+      static const size_t rows = 4;
+
+      //------------------------------------------------------------------------
+      //! @return the counter of an item in one row
+      //------------------------------------------------------------------------
+      size_t index( uint64_t hash, size_t row ) const
+      {
+        static const uint64_t seeds[rows] = { 0xc3a5c85c97cb3127ULL,
+                                              0xb492b66fbe98f273ULL,
+                                              0x9ae16a3b2f90404fULL,
+                                              0xcbf29ce484222325ULL };
+        uint64_t h = ( hash + seeds[row] ) * 0x9e3779b97f4a7c15ULL;
+        return row * ( mask + 1 ) + ( ( h ^ ( h >> 32 ) ) & mask );
+      }
+
+      //------------------------------------------------------------------------
+      //! Halve every counter
+      //------------------------------------------------------------------------
+      void age()
+      {
+        for( size_t i = 0; i < rows * ( mask + 1 ) / 16; ++i )
+        {
+          uint64_t old = words[i].load( std::memory_order_relaxed );
+          while( !words[i].compare_exchange_weak(
+                   old, ( old >> 1 ) & 0x7777777777777777ULL,
+                   std::memory_order_relaxed ) );
+        }
+        samples.fetch_sub( window / 2, std::memory_order_relaxed );
+      }
+
+      std::unique_ptr<std::atomic<uint64_t>[]> words;
+      size_t                                   mask;
+      size_t                                   window;
+      std::atomic<size_t>                      samples;
+  };
+}
+
+#endif /* __FUSECACHE_ADMISSION_HPP__ */
@@ -0,0 +1,362 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2012-2013 by European Organization for Nuclear Research (CERN)
+// Author: Justin Salmon <jsalmon@cern.ch>
+//------------------------------------------------------------------------------
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with This program.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#ifndef __FUSECACHE_CHECKSUM_HPP__
+#define __FUSECACHE_CHECKSUM_HPP__
+
+#include <string>
+#include <chrono>
+#include <cstring>
+#include <stdint.h>
+
+#include "stats.h"
+
+#if defined( __x86_64__ ) && ( defined( __GNUC__ ) || defined( __clang__ ) )
+#include <nmmintrin.h>
+#define FUSECACHE_CRC32C_SSE42
+#endif
+
+#if defined( __aarch64__ ) && defined( __linux__ ) && \
+    ( defined( __GNUC__ ) || defined( __clang__ ) )
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define FUSECACHE_CRC32C_ARMV8
+#endif
+
+//------------------------------------------------------------------------------
+// CRC32C (Castagnoli), as used by iSCSI, ext4 and btrfs. The kernel to use is
+// picked once at run time: the SSE 4.2 crc32 instruction on x86-64, the
+// ARMv8 CRC32 extension on 64-bit ARM, or tables otherwise.
+//
+// The crc32 instructions take three cycles but can start one per cycle, so
+// the hardware kernels run three lanes over consecutive stretches of the
+// buffer at once and then combine them. Appending n bytes to a CRC is linear
+// in the CRC, so combining only takes a table lookup per byte of the CRC.
+//------------------------------------------------------------------------------
+
+namespace fusecache
+{
+  namespace checksum
+  {
+    typedef uint32_t ( *kernel_t )( uint32_t, const char*, size_t );
+
+    //--------------------------------------------------------------------------
+    //! Portable kernel, eight bytes at a time using eight tables
+    //--------------------------------------------------------------------------
+    inline const uint32_t ( *tables() )[256]
+    {
+      struct tables_t
+      {
+        uint32_t t[8][256];
+
+        tables_t()
+        {
+          for( uint32_t i = 0; i < 256; ++i )
+          {
+            uint32_t c = i;
+            for( int k = 0; k < 8; ++k )
+              c = c & 1 ? ( c >> 1 ) ^ 0x82f63b78 : c >> 1;
+            t[0][i] = c;
+          }
+          for( uint32_t i = 0; i < 256; ++i )
+            for( int k = 1; k < 8; ++k )
+              t[k][i] = ( t[k - 1][i] >> 8 ) ^ t[0][t[k - 1][i] & 0xff];
+        }
+      };
+
+      static const tables_t tables;
+      return tables.t;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Bytes each lane of a hardware kernel covers per round
+    //--------------------------------------------------------------------------
+    static const size_t lane = 1024;
+
+    inline uint32_t software( uint32_t crc, const char *p, size_t n );
+
+    //--------------------------------------------------------------------------
+    //! @return CRC register after lane zero bytes, as four byte-wise tables
+    //--------------------------------------------------------------------------
+    inline const uint32_t ( *shift_tables() )[256]
+    {
+      struct shift_t
+      {
+        uint32_t t[4][256];
+
+        shift_t()
+        {
+          char     zeros[lane] = { 0 };
+          uint32_t basis[32];
+          for( int bit = 0; bit < 32; ++bit )
+            basis[bit] = software( 1u << bit, zeros, lane );
+
+          for( int k = 0; k < 4; ++k )
+            for( uint32_t v = 0; v < 256; ++v )
+            {
+              t[k][v] = 0;
+              for( int bit = 0; bit < 8; ++bit )
+                if( v >> bit & 1 ) t[k][v] ^= basis[8 * k + bit];
+            }
+        }
+      };
+
+      static const shift_t shift;
+      return shift.t;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Combine three lanes: a covers the first stretch, b and c the next two
+    //! starting from a zero register
+    //--------------------------------------------------------------------------
+    inline uint32_t combine( uint32_t a, uint32_t b, uint32_t c )
+    {
+      const uint32_t ( *t )[256] = shift_tables();
+      a = t[0][a & 0xff] ^ t[1][( a >> 8 ) & 0xff] ^
+          t[2][( a >> 16 ) & 0xff] ^ t[3][a >> 24] ^ b;
+      return t[0][a & 0xff] ^ t[1][( a >> 8 ) & 0xff] ^
+             t[2][( a >> 16 ) & 0xff] ^ t[3][a >> 24] ^ c;
+    }
+
+    inline uint32_t software( uint32_t crc, const char *p, size_t n )
+    {
+      const uint32_t ( *t )[256] = tables();
+      const unsigned char *q     = (const unsigned char*) p;
+
+      for( ; n >= 8; q += 8, n -= 8 )
+      {
+        uint32_t lo = crc ^ ( q[0] | q[1] << 8 | q[2] << 16 |
+                              (uint32_t) q[3] << 24 );
+        crc = t[7][lo & 0xff] ^ t[6][( lo >> 8 ) & 0xff] ^
+              t[5][( lo >> 16 ) & 0xff] ^ t[4][lo >> 24] ^
+              t[3][q[4]] ^ t[2][q[5]] ^ t[1][q[6]] ^ t[0][q[7]];
+      }
+      for( ; n; ++q, --n )
+        crc = ( crc >> 8 ) ^ t[0][( crc ^ *q ) & 0xff];
+      return crc;
+    }
+
+#ifdef FUSECACHE_CRC32C_SSE42
+    //--------------------------------------------------------------------------
+    //! SSE 4.2 kernel
+    //--------------------------------------------------------------------------
+    __attribute__(( target( "sse4.2" ) ))
+    inline uint32_t sse42( uint32_t crc, const char *p, size_t n )
+    {
+      uint64_t c = crc;
+      for( ; n >= 3 * lane; p += 3 * lane, n -= 3 * lane )
+      {
+        uint64_t a = c, b = 0, d = 0;
+        for( size_t i = 0; i < lane; i += 8 )
+        {
+          uint64_t x, y, z;
+          memcpy( &x, p + i, 8 );
+          memcpy( &y, p + lane + i, 8 );
+          memcpy( &z, p + 2 * lane + i, 8 );
+          a = _mm_crc32_u64( a, x );
+          b = _mm_crc32_u64( b, y );
+          d = _mm_crc32_u64( d, z );
+        }
+        c = combine( a, b, d );
+      }
+
+      for( ; n >= 8; p += 8, n -= 8 )
+      {
+        uint64_t w;
+        memcpy( &w, p, 8 );
+        c = _mm_crc32_u64( c, w );
+      }
+      for( ; n; ++p, --n )
+        c = _mm_crc32_u8( (uint32_t) c, *p );
+      return (uint32_t) c;
+    }
+#endif
+
+#ifdef FUSECACHE_CRC32C_ARMV8
+    //--------------------------------------------------------------------------
+    //! ARMv8 CRC32 extension kernel
+    //--------------------------------------------------------------------------
+#ifdef __clang__
+    __attribute__(( target( "crc" ) ))
+#else
+    __attribute__(( target( "+crc" ) ))
+#endif
+    inline uint32_t armv8( uint32_t crc, const char *p, size_t n )
+    {
+      for( ; n >= 3 * lane; p += 3 * lane, n -= 3 * lane )
+      {
+        uint32_t a = crc, b = 0, c = 0;
+        for( size_t i = 0; i < lane; i += 8 )
+        {
+          uint64_t x, y, z;
+          memcpy( &x, p + i, 8 );
+          memcpy( &y, p + lane + i, 8 );
+          memcpy( &z, p + 2 * lane + i, 8 );
+          __asm__( "crc32cx %w0, %w0, %x1" : "+r"( a ) : "r"( x ) );
+          __asm__( "crc32cx %w0, %w0, %x1" : "+r"( b ) : "r"( y ) );
+          __asm__( "crc32cx %w0, %w0, %x1" : "+r"( c ) : "r"( z ) );
+        }
+        crc = combine( a, b, c );
+      }
+
+      for( ; n >= 8; p += 8, n -= 8 )
+      {
+        uint64_t w;
+        memcpy( &w, p, 8 );
+        __asm__( "crc32cx %w0, %w0, %x1" : "+r"( crc ) : "r"( w ) );
+      }
+      for( ; n; ++p, --n )
+      {
+        uint32_t b = (unsigned char) *p;
+        __asm__( "crc32cb %w0, %w0, %w1" : "+r"( crc ) : "r"( b ) );
+      }
+      return crc;
+    }
+#endif
+
+    //--------------------------------------------------------------------------
+    //! @return the fastest kernel this CPU can run
+    //--------------------------------------------------------------------------
+    inline kernel_t select( const char **name = 0 )
+    {
+      const char *dummy;
+      if( !name ) name = &dummy;
+
+#ifdef FUSECACHE_CRC32C_SSE42
+      __builtin_cpu_init();
+      if( __builtin_cpu_supports( "sse4.2" ) )
+      {
+        *name = "sse4.2";
+        return sse42;
+      }
+#endif
+#ifdef FUSECACHE_CRC32C_ARMV8
+      if( getauxval( AT_HWCAP ) & HWCAP_CRC32 )
+      {
+        *name = "armv8";
+        return armv8;
+      }
+#endif
+      *name = "software";
+      return software;
+    }
+
+    inline kernel_t kernel()
+    {
+      static const kernel_t k = select();
+      return k;
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  //! @param crc CRC of the preceding bytes, to checksum data in pieces
+  //! @return CRC32C of a buffer
+  //----------------------------------------------------------------------------
+  inline uint32_t crc32c( const char *p, size_t n, uint32_t crc = 0 )
+  {
+    return ~checksum::kernel()( ~crc, p, n );
+  }
+
+  inline uint32_t crc32c( const std::string &data )
+  {
+    return crc32c( data.data(), data.size() );
+  }
+
+  //----------------------------------------------------------------------------
+  //! Copy a buffer and checksum it in one pass: each piece is checksummed
+  //! right after it is copied, while it is still in the L1 cache
+  //!
+  //! @return CRC32C of the buffer
+  //----------------------------------------------------------------------------
+  inline uint32_t crc32c_copy( char *dst, const char *src, size_t n )
+  {
+    const size_t       piece  = 4096;
+    checksum::kernel_t kernel = checksum::kernel();
+    uint32_t           crc    = ~0u;
+
+    for( size_t pos = 0; pos < n; pos += piece )
+    {
+      size_t len = n - pos < piece ? n - pos : piece;
+      memcpy( dst + pos, src + pos, len );
+      crc = kernel( crc, dst + pos, len );
+    }
+    return ~crc;
+  }
+
+  namespace checksum
+  {
+    //--------------------------------------------------------------------------
+    //! Count a check of n bytes which began at start
+    //--------------------------------------------------------------------------
+    inline bool counted( stats                                 *counters,
+                         size_t                                 n,
+                         std::chrono::steady_clock::time_point  start,
+                         bool                                   ok )
+    {
+      counters->verified_bytes += n;
+      counters->verify_nsec    += std::chrono::duration_cast<
+        std::chrono::nanoseconds>( std::chrono::steady_clock::now() -
+                                   start ).count();
+      if( !ok ) counters->corrupt++;
+      return ok;
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  //! Check data against the checksum it was stored with
+  //!
+  //! @param counters if given, count the bytes, the time taken and failures
+  //! @return true if the data is intact
+  //----------------------------------------------------------------------------
+  inline bool verify_checksum( const std::string &data,
+                               uint32_t           crc,
+                               stats             *counters )
+  {
+    if( !counters ) return crc32c( data ) == crc;
+
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    return checksum::counted( counters, data.size(), start,
+                              crc32c( data ) == crc );
+  }
+
+  //----------------------------------------------------------------------------
+  //! Copy data and check it against the checksum it was stored with, in one
+  //! pass over it. The time counted includes the copy.
+  //!
+  //! @param out      receives the data, even if it is not intact
+  //! @param counters if given, count the bytes, the time taken and failures
+  //! @return true if the data is intact
+  //----------------------------------------------------------------------------
+  inline bool verify_copy( std::string       &out,
+                           const std::string &data,
+                           uint32_t           crc,
+                           stats             *counters )
+  {
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+    out.resize( data.size() );
+    bool ok = data.empty() ||
+              crc32c_copy( &out[0], data.data(), data.size() ) == crc;
+    return counters ? checksum::counted( counters, data.size(), start, ok ) :
+                      ok;
+  }
+}
+
+#endif /* __FUSECACHE_CHECKSUM_HPP__ */
@@ -0,0 +1,510 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2012-2013 by European Organization for Nuclear Research (CERN)
+// Author: Justin Salmon <jsalmon@cern.ch>
+//------------------------------------------------------------------------------
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with This program.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#ifndef __FUSECACHE_DELTA_HPP__
+#define __FUSECACHE_DELTA_HPP__
+
+#include <fuse_lowlevel.h>
+#include <unordered_map>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+
+namespace fusecache
+{
+  //----------------------------------------------------------------------------
+  //! One step of a delta upload. Each op replaces a byte range of the file;
+  //! bytes no op covers are unchanged. COPY sources refer to the file as it
+  //! was before any op of the upload is applied. A TRUNCATE, if there is
+  //! one, comes last.
+  //!
+  //! A delta only makes sense against the version of the file it was
+  //! encoded for. LENGTH, if there is one, comes first and gives the length
+  //! of that version, and COPY and VERIFY give the strong_hash() of the old
+  //! bytes they rely on. The backend must check all of them before applying
+  //! anything, and refuse the delta with -ESTALE if any does not match.
+  //----------------------------------------------------------------------------
+  struct delta_op
+  {
+    enum type_t
+    {
+      COPY,             //!< copy len bytes from offset src of the old file
+      DATA,             //!< write the bytes in data
+      TRUNCATE,         //!< cut or extend the new file to off bytes
+      VERIFY,           //!< the old file has these len bytes at off
+      LENGTH            //!< the old file is off bytes long
+    };
+
+    type_t      type;
+    off_t       off;    //!< where the bytes go in the new file, or a length
+    size_t      len;
+    off_t       src;    //!< COPY only
+    std::string data;   //!< DATA only
+    uint64_t    hash;   //!< COPY and VERIFY: strong_hash() of the old bytes
+  };
+
+  //----------------------------------------------------------------------------
+  //! rsync style weak checksum, which can be rolled along a buffer one byte
+  //! at a time
+  //----------------------------------------------------------------------------
+  class rolling_checksum
+  {
+    public:
+      rolling_checksum() : a( 0 ), b( 0 ), len( 0 ) {};
+
+      //------------------------------------------------------------------------
+      //! Start over on a block
+      //------------------------------------------------------------------------
+      void reset( const char *p, size_t n )
+      {
+        a = b = 0;
+        len   = n;
+        for( size_t i = 0; i < n; ++i )
+        {
+          a += (unsigned char) p[i];
+          b += ( n - i ) * (unsigned char) p[i];
+        }
+      }
+
+      //------------------------------------------------------------------------
+      //! Slide the block one byte along
+      //------------------------------------------------------------------------
+      void roll( unsigned char out, unsigned char in )
+      {
+        a += in - out;
+        b += a - len * out;
+      }
+
+      uint32_t value() const
+      {
+        return ( a & 0xffff ) | ( b << 16 );
+      }
+
+      static uint32_t of( const char *p, size_t n )
+      {
+        rolling_checksum sum;
+        sum.reset( p, n );
+        return sum.value();
+      }
+
+    private:
+      uint32_t a;
+      uint32_t b;
+      uint32_t len;
+  };
+
+  //----------------------------------------------------------------------------
+  //! 64-bit hash confirming a weak checksum match
+  //----------------------------------------------------------------------------
+  inline uint64_t strong_hash( const char *p, size_t n )
+  {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ ( n * 0xff51afd7ed558ccdULL );
+    size_t   i = 0;
+    for( ; i + 8 <= n; i += 8 )
+    {
+      uint64_t w;
+      memcpy( &w, p + i, 8 );
+      h  = ( h ^ w ) * 0xff51afd7ed558ccdULL;
+      h ^= h >> 32;
+    }
+
+    uint64_t w = 0;
+    memcpy( &w, p + i, n - i );
+    h  = ( h ^ w ) * 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 29;
+    return h;
+  }
+
+  //----------------------------------------------------------------------------
+  //! Block signatures of the files as they were last read from, or written
+  //! to, the backend, and their lengths where we saw them end. A block is
+  //! the size of a cache page; blocks we never saw are unknown. 16 bytes per
+  //! known block.
+  //----------------------------------------------------------------------------
+  class signature_store
+  {
+    public:
+      struct block_t
+      {
+        uint64_t strong;
+        uint32_t weak;
+        uint32_t len;   //!< zero if unknown
+      };
+      typedef std::vector<block_t> blocks_t;
+
+      //------------------------------------------------------------------------
+      //! Constructor
+      //------------------------------------------------------------------------
+      signature_store() : block( 64 * 1024 ), capacity( 0 ) {};
+
+      //------------------------------------------------------------------------
+      //! Set the block size and the most files to keep signatures for. Drops
+      //! all signatures.
+      //------------------------------------------------------------------------
+      void configure( size_t block, size_t capacity )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        files.clear();
+        this->block    = block;
+        this->capacity = capacity;
+      }
+
+      //------------------------------------------------------------------------
+      //! Remember the signature of one block
+      //------------------------------------------------------------------------
+      void record( fuse_ino_t ino, uint64_t index, const std::string &data )
+      {
+        if( capacity == 0 || data.empty() ) return;
+
+        block_t b = { strong_hash( data.data(), data.size() ),
+                      rolling_checksum::of( data.data(), data.size() ),
+                      (uint32_t) data.size() };
+
+        std::lock_guard<std::mutex> lock( mutex );
+        blocks_t &blocks = insert( ino ).blocks;
+        if( blocks.size() <= index ) blocks.resize( index + 1, block_t() );
+        blocks[index] = b;
+      }
+
+      //------------------------------------------------------------------------
+      //! Remember where a file ends
+      //!
+      //! @param size its length, or -1 if no longer known
+      //------------------------------------------------------------------------
+      void ended( fuse_ino_t ino, off_t size )
+      {
+        if( capacity == 0 ) return;
+
+        std::lock_guard<std::mutex> lock( mutex );
+        files_t::iterator it = files.find( ino );
+        if( it != files.end() )
+          it->second.size = size;
+        else if( size >= 0 )
+          insert( ino ).size = size;
+      }
+
+      //------------------------------------------------------------------------
+      //! Forget the blocks overlapping a byte range, and the length of the
+      //! file if the range reaches its end
+      //------------------------------------------------------------------------
+      void erase( fuse_ino_t ino, off_t off, size_t size )
+      {
+        if( size == 0 ) return;
+
+        std::lock_guard<std::mutex> lock( mutex );
+        files_t::iterator it = files.find( ino );
+        if( it == files.end() ) return;
+
+        file_t  &file = it->second;
+        uint64_t last = ( off + size - 1 ) / block;
+        for( uint64_t index = off / block;
+             index <= last && index < file.blocks.size(); ++index )
+          file.blocks[index] = block_t();
+        if( (uint64_t) off + size > (uint64_t) file.size ) file.size = -1;
+      }
+
+      //------------------------------------------------------------------------
+      //! Forget everything about a file
+      //------------------------------------------------------------------------
+      void erase( fuse_ino_t ino )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        files.erase( ino );
+      }
+
+      //------------------------------------------------------------------------
+      //! @param size receives the length of the file, or -1 if not known
+      //! @return false if nothing is known about a file
+      //------------------------------------------------------------------------
+      bool get( fuse_ino_t ino, blocks_t &blocks, off_t &size )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        files_t::iterator it = files.find( ino );
+        if( it == files.end() ) return false;
+
+        blocks = it->second.blocks;
+        size   = it->second.size;
+        return true;
+      }
+
+      //------------------------------------------------------------------------
+      //! Load signatures saved by save(). A missing or unreadable file, or
+      //! one written with another block size, leaves the store empty. A file
+      //! claiming more blocks than its length or the rest of the store hold
+      //! ends the load there.
+      //------------------------------------------------------------------------
+      void load( const std::string &path )
+      {
+        std::ifstream in( path.c_str(), std::ios::binary | std::ios::ate );
+        std::streamoff end = in ? (std::streamoff) in.tellg() : 0;
+        char          magic[4];
+        uint64_t      bsize = 0, count = 0;
+
+        in.seekg( 0 );
+        in.read( magic, sizeof( magic ) );
+        in.read( (char*) &bsize, sizeof( bsize ) );
+        in.read( (char*) &count, sizeof( count ) );
+        if( !in || std::string( magic, 4 ) != "FCS2" || bsize != block )
+          return;
+
+        std::lock_guard<std::mutex> lock( mutex );
+        files.clear();
+        for( uint64_t i = 0; i < count && files.size() < capacity; ++i )
+        {
+          fuse_ino_t ino;
+          int64_t    size = -1;
+          uint64_t   n    = 0;
+          in.read( (char*) &ino, sizeof( ino ) );
+          in.read( (char*) &size, sizeof( size ) );
+          in.read( (char*) &n, sizeof( n ) );
+          if( !in ) break;
+
+          uint64_t left = end - (std::streamoff) in.tellg();
+          if( n > left / sizeof( block_t ) ) break;
+          if( size >= 0 && n > ( size + block - 1 ) / block ) break;
+
+          file_t file;
+          file.blocks.resize( n );
+          file.size = size;
+          if( n ) in.read( (char*) &file.blocks[0], n * sizeof( block_t ) );
+          if( !in ) break;
+          files[ino].swap( file );
+        }
+      }
+
+      //------------------------------------------------------------------------
+      //! Save the signatures so that they survive a restart
+      //!
+      //! @return false if the file could not be written
+      //------------------------------------------------------------------------
+      bool save( const std::string &path )
+      {
+        std::string   tmp = path + ".tmp";
+        std::ofstream out( tmp.c_str(), std::ios::binary | std::ios::trunc );
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          uint64_t bsize = block, count = files.size();
+          out.write( "FCS2", 4 );
+          out.write( (const char*) &bsize, sizeof( bsize ) );
+          out.write( (const char*) &count, sizeof( count ) );
+          for( files_t::iterator it = files.begin(); it != files.end(); ++it )
+          {
+            const blocks_t &blocks = it->second.blocks;
+            int64_t         size   = it->second.size;
+            uint64_t        n      = blocks.size();
+            out.write( (const char*) &it->first, sizeof( it->first ) );
+            out.write( (const char*) &size, sizeof( size ) );
+            out.write( (const char*) &n, sizeof( n ) );
+            if( n )
+              out.write( (const char*) &blocks[0], n * sizeof( block_t ) );
+          }
+        }
+        out.close();
+        return out && ::rename( tmp.c_str(), path.c_str() ) == 0;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return number of files with signatures
+      //------------------------------------------------------------------------
+      size_t size()
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        return files.size();
+      }
+
+    private:
+      struct file_t
+      {
+        file_t() : size( -1 ) {};
+
+        void swap( file_t &other )
+        {
+          blocks.swap( other.blocks );
+          std::swap( size, other.size );
+        }
+
+        blocks_t blocks;
+        off_t    size;    //!< length of the file, or -1 if not known
+      };
+      typedef std::unordered_map<fuse_ino_t, file_t> files_t;
+
+      //------------------------------------------------------------------------
+      //! @return the entry of a file, made room for if it is new
+      //------------------------------------------------------------------------
+      file_t &insert( fuse_ino_t ino )
+      {
+        files_t::iterator it = files.find( ino );
+        if( it != files.end() ) return it->second;
+
+        if( files.size() >= capacity ) files.erase( files.begin() );
+        return files[ino];
+      }
+
+      std::mutex mutex;
+      files_t    files;
+      size_t     block;
+      size_t     capacity;
+  };
+
+  //----------------------------------------------------------------------------
+  //! Works out how to turn the old version of a file into the new one, given
+  //! the block signatures of the old version and the changed byte ranges of
+  //! the new one. Each range is searched at every byte offset for blocks of
+  //! the old version, which are then copied rather than sent; bytes which
+  //! turn out to be the same as before at the same offset are only
+  //! verified. Every op relying on the old version carries the hash of the
+  //! block it relies on, so copies are not merged.
+  //----------------------------------------------------------------------------
+  class delta_encoder
+  {
+    public:
+      //------------------------------------------------------------------------
+      //! Constructor
+      //!
+      //! @param old   signatures of the old version
+      //! @param block block size the signatures were taken with
+      //------------------------------------------------------------------------
+      delta_encoder( const signature_store::blocks_t &old, size_t block ) :
+        old( old ), block( block )
+      {
+        for( size_t i = 0; i < old.size(); ++i )
+          if( old[i].len == block ) weak.insert( weak_t::value_type(
+                                                   old[i].weak, i ) );
+      }
+
+      //------------------------------------------------------------------------
+      //! Encode one changed range of the new file
+      //!
+      //! @param start offset of the range in the new file
+      //! @param data  new contents of the range
+      //! @param ops   receives the ops, appended in file order
+      //------------------------------------------------------------------------
+      void encode( off_t                  start,
+                   const std::string     &data,
+                   std::vector<delta_op> &ops )
+      {
+        size_t           n       = data.size();
+        size_t           pos     = 0;
+        size_t           literal = 0;
+        rolling_checksum sum;
+
+        if( !weak.empty() && n >= block ) sum.reset( data.data(), block );
+        while( !weak.empty() && pos + block <= n )
+        {
+          int64_t match = find( sum.value(), data.data() + pos,
+                                ( start + pos ) / block );
+          if( match >= 0 )
+          {
+            add_data( start + literal, data, literal, pos - literal, ops );
+            add_copy( start + pos, match, ops );
+
+            pos    += block;
+            literal = pos;
+            if( pos + block <= n ) sum.reset( data.data() + pos, block );
+            continue;
+          }
+
+          if( pos + block < n )
+            sum.roll( data[pos], data[pos + block] );
+          ++pos;
+        }
+
+        //----------------------------------------------------------------------
+        // A short last block can only have stayed where it was
+        //----------------------------------------------------------------------
+        if( literal < n && n - literal < block &&
+            ( start + literal ) % block == 0 )
+        {
+          uint64_t index = ( start + literal ) / block;
+          if( index < old.size() && old[index].len == n - literal &&
+              old[index].strong == strong_hash( data.data() + literal,
+                                                n - literal ) )
+          {
+            delta_op op = { delta_op::VERIFY, (off_t) ( index * block ),
+                            n - literal, 0, std::string(),
+                            old[index].strong };
+            ops.push_back( op );
+            literal = n;
+          }
+        }
+
+        add_data( start + literal, data, literal, n - literal, ops );
+      }
+
+    private:
+      typedef std::unordered_multimap<uint32_t, uint64_t> weak_t;
+
+      //------------------------------------------------------------------------
+      //! @param same index of the old block at the offset of the window
+      //! @return index of an old block matching a window, preferring the one
+      //!         at the same offset, or -1
+      //------------------------------------------------------------------------
+      int64_t find( uint32_t sum, const char *p, uint64_t same )
+      {
+        std::pair<weak_t::iterator, weak_t::iterator> range =
+          weak.equal_range( sum );
+        if( range.first == range.second ) return -1;
+
+        uint64_t strong = strong_hash( p, block );
+        int64_t  match  = -1;
+        for( weak_t::iterator it = range.first; it != range.second; ++it )
+        {
+          if( old[it->second].strong != strong ) continue;
+          if( it->second == same ) return same;
+          if( match < 0 || it->second < (uint64_t) match ) match = it->second;
+        }
+        return match;
+      }
+
+      //------------------------------------------------------------------------
+      //! Append a COPY of an old block, or a VERIFY if the block would be
+      //! copied onto itself
+      //------------------------------------------------------------------------
+      void add_copy( off_t off, uint64_t index, std::vector<delta_op> &ops )
+      {
+        off_t    src = index * block;
+        delta_op op  = { off == src ? delta_op::VERIFY : delta_op::COPY, off,
+                         block, src, std::string(), old[index].strong };
+        ops.push_back( op );
+      }
+
+      void add_data( off_t                  off,
+                     const std::string     &data,
+                     size_t                 pos,
+                     size_t                 len,
+                     std::vector<delta_op> &ops )
+      {
+        if( len == 0 ) return;
+
+        delta_op op = { delta_op::DATA, off, len, 0, data.substr( pos, len ),
+                        0 };
+        ops.push_back( op );
+      }
+
+      const signature_store::blocks_t &old;
+      size_t                           block;
+      weak_t                           weak;
+  };
+}
+
+#endif /* __FUSECACHE_DELTA_HPP__ */
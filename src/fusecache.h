@@ -22,12 +22,147 @@
 #include <llfusexx.h>
 #include <iostream>
 #include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include "admission.h"
+#include "checksum.h"
+#include "delta.h"
+#include "inodetable.h"
+#include "pagecache.h"
+#include "peer.h"
+#include "prefetcher.h"
+#include "slabstore.h"
+#include "threadpool.h"
+#include "stats.h"
 
 namespace fusecache
 {
+  //----------------------------------------------------------------------------
+  //! Tunables for the cache layer. The user subclass may change these in its
+  //! constructor; they are applied when the filesystem is initialized.
+  //----------------------------------------------------------------------------
+  struct config
+  {
+    size_t   page_size;         //!< size of a cache page in bytes
+    size_t   cache_pages;       //!< maximum number of pages kept in memory
+    unsigned page_ttl;          //!< seconds until a cached page or small file
+                                //!< is stale, zero to keep them fresh forever
+    size_t   workers;           //!< threads issuing backend requests; at
+                                //!< least two are run
+    unsigned read_timeout;      //!< milliseconds a read waits for the backend
+                                //!< before giving up, zero to wait forever
+    double   hedge_percentile;  //!< backend latency percentile after which a
+                                //!< duplicate request is sent, as a fraction
+                                //!< such as 0.95, zero to disable; values
+                                //!< above one are taken as percentages
+    unsigned hedge_delay;       //!< hedge delay in milliseconds used until
+                                //!< enough latencies have been observed
+    size_t   stripe_size;       //!< largest backend request in bytes; bigger
+                                //!< misses are split and fetched in parallel
+    size_t   readahead;         //!< bytes to fetch ahead of sequential
+                                //!< readers, zero to disable
+    size_t   speculative_workers; //!< most workers busy with read-ahead,
+                                //!< prefetches and other fetches nobody waits
+                                //!< for; zero for three quarters of workers.
+                                //!< At most all workers but one, so that one
+                                //!< is always left for reads
+    size_t   small_file_size;   //!< files up to this size are fetched whole on
+                                //!< open and packed into slabs, zero to disable
+    size_t   slab_size;         //!< size of a small file slab in bytes
+    size_t   slab_memory;       //!< number of slabs kept in memory
+    size_t   slab_disk;         //!< number of slabs kept in the slab file
+    unsigned hot_dir_reads;     //!< directory listings after which the small
+                                //!< files in a directory are fetched in bulk
+    size_t   bulk_files;        //!< most files to ask for in one bulk fetch
+    size_t   prefetch_rate;     //!< bytes per second which may be spent on
+                                //!< predicted files, zero to disable
+    size_t   prefetch_size;     //!< bytes to fetch from the start of a
+                                //!< predicted file
+    double   prefetch_share;    //!< share of the accesses following a file
+                                //!< that a successor needs to be predicted
+    size_t   prefetch_model;    //!< most files to learn successors for;
+                                //!< the least recently seen make way for
+                                //!< new ones
+    admission_t admission;      //!< which fetched pages may enter the cache
+    size_t   staging_pages;     //!< read-ahead pages kept outside the cache
+                                //!< until they are read, if not admitted
+    std::string cache_dir;      //!< directory for on-disk cache files, empty
+                                //!< to cache in memory only
+    std::vector<std::string> peers; //!< "host:port" of every fusecache daemon
+                                //!< sharing pages, in the same order on
+                                //!< every node; empty to disable. Files
+                                //!< are named by file_id() between peers,
+                                //!< and each stripe of a file is owned by
+                                //!< one peer, so page_size and stripe_size
+                                //!< must match on every node.
+                                //!< Peers are not authenticated, so these
+                                //!< must be addresses only trusted hosts
+                                //!< reach
+    int      peer_self;         //!< index of this daemon in peers, -1 to ask
+                                //!< the peers without serving them. The
+                                //!< server listens on exactly that address
+                                //!< and serves any page to anyone who
+                                //!< connects; an empty or wildcard host
+                                //!< listens on every interface
+    unsigned peer_timeout;      //!< milliseconds to wait for a peer before
+                                //!< going to the backend instead
+    size_t   signatures;        //!< most files to keep block signatures for,
+                                //!< so that writes made offline can be
+                                //!< uploaded as deltas; zero to disable
+    unsigned sync_interval;     //!< milliseconds between checks of status()
+                                //!< while writes made offline wait to be
+                                //!< uploaded; zero to only check on I/O
+    bool     verify_pages;      //!< check the checksum of pages in memory on
+                                //!< every hit; data read back from disk or
+                                //!< from peers is always checked
+
+    config() :
+      page_size( 64 * 1024 ),
+      cache_pages( 4096 ),
+      page_ttl( 0 ),
+      workers( 8 ),
+      read_timeout( 0 ),
+      hedge_percentile( 0 ),
+      hedge_delay( 50 ),
+      stripe_size( 1024 * 1024 ),
+      readahead( 8 * 1024 * 1024 ),
+      speculative_workers( 0 ),
+      small_file_size( 16 * 1024 ),
+      slab_size( 1024 * 1024 ),
+      slab_memory( 64 ),
+      slab_disk( 4096 ),
+      hot_dir_reads( 2 ),
+      bulk_files( 256 ),
+      prefetch_rate( 16 * 1024 * 1024 ),
+      prefetch_size( 256 * 1024 ),
+      prefetch_share( 0.3 ),
+      prefetch_model( 1024 * 1024 ),
+      admission( ADMIT_ALL ),
+      staging_pages( 256 ),
+      peer_self( -1 ),
+      peer_timeout( 200 ),
+      signatures( 65536 ),
+      sync_interval( 1000 ),
+      verify_pages( false ) {};
+  };
+
   //----------------------------------------------------------------------------
   //! The main layer between FUSE and the user filesystem implementation. This
   //! is a write-through cache which caches both file data and metadata.
+  //! While the network server is offline, writes are kept in the cache and
+  //! uploaded once it is back.
   //!
   //! We use the curiously recurring template pattern to subclass llfusexx::fs
   //! hence forcing us to implement all the low-level fuse functions.
@@ -53,19 +188,275 @@ namespace fusecache
       //------------------------------------------------------------------------
       //! Constructor
       //------------------------------------------------------------------------
-      fs() {};
+      fs() : cache( cfg.page_size, cfg.cache_pages ),
+             staging( cfg.page_size, cfg.staging_pages ), syncing( false ),
+             watching( false )
+      {
+        for( size_t i = 0; i < write_slots; ++i )
+        {
+          writes[i].generation = 0;
+          writes[i].last       = 0;
+        }
+      }
 
       //------------------------------------------------------------------------
       //! Destructor
       //------------------------------------------------------------------------
-      virtual ~fs() {};
+      virtual ~fs()
+      {
+        unwatch();
+      }
 
       //------------------------------------------------------------------------
-      //! @return status of the network server
+      //! @return status of the network server. This may be called from
+      //!         several threads at once.
       //------------------------------------------------------------------------
       virtual fusecache_status_t status() = 0;
 
-      std::string cached;
+      //------------------------------------------------------------------------
+      //! Read a byte range from the network server. This may be called from
+      //! several threads at once.
+      //!
+      //! @return zero on success, a negative errno value on failure
+      //------------------------------------------------------------------------
+      virtual int read( fuse_ino_t   ino,
+                        size_t       size,
+                        off_t        off,
+                        std::string &buf ) = 0;
+
+      //------------------------------------------------------------------------
+      //! Read a byte range from a particular replica of the network server.
+      //! Hedged requests are spread over the replicas; the default sends
+      //! everything to the one server.
+      //!
+      //! @param replica index between zero and replicas() - 1
+      //! @return zero on success, a negative errno value on failure
+      //------------------------------------------------------------------------
+      virtual int read_replica( fuse_ino_t   ino,
+                                size_t       size,
+                                off_t        off,
+                                std::string &buf,
+                                int          replica )
+      {
+        return read( ino, size, off, buf );
+      }
+
+      //------------------------------------------------------------------------
+      //! @return number of replicas the network server can be reached at
+      //------------------------------------------------------------------------
+      virtual int replicas()
+      {
+        return 1;
+      }
+
+      //------------------------------------------------------------------------
+      //! Write a byte range to the network server. Used to upload the writes
+      //! made while it was offline.
+      //!
+      //! @return zero on success, a negative errno value on failure
+      //------------------------------------------------------------------------
+      virtual int write( fuse_ino_t         ino,
+                         const std::string &buf,
+                         off_t              off ) = 0;
+
+      //------------------------------------------------------------------------
+      //! Apply a delta to a file on the network server, see delta_op. The
+      //! file must be checked against the LENGTH, COPY and VERIFY ops first,
+      //! and the delta refused with -ESTALE if they do not match. Backends
+      //! which refuse it, or cannot do this at all and return -ENOSYS, have
+      //! the changed pages uploaded with write() and truncate() instead.
+      //!
+      //! @return zero on success, a negative errno value on failure
+      //------------------------------------------------------------------------
+      virtual int write_delta( fuse_ino_t                   ino,
+                               const std::vector<delta_op> &ops )
+      {
+        return -ENOSYS;
+      }
+
+      //------------------------------------------------------------------------
+      //! Set the length of a file on the network server. Used to upload the
+      //! truncations made while it was offline if write_delta() is not
+      //! available; such files stay dirty on backends without either.
+      //!
+      //! @return zero on success, a negative errno value on failure
+      //------------------------------------------------------------------------
+      virtual int truncate( fuse_ino_t ino, off_t size )
+      {
+        return -ENOSYS;
+      }
+
+      //------------------------------------------------------------------------
+      //! List the regular files in a directory together with their sizes, so
+      //! that the small ones can be fetched in bulk. The default lists nothing.
+      //!
+      //! @return zero on success, a negative errno value on failure
+      //------------------------------------------------------------------------
+      virtual int list_files( fuse_ino_t                                 dir,
+                              std::vector<std::pair<fuse_ino_t, off_t> > &files )
+      {
+        return -ENOSYS;
+      }
+
+      //------------------------------------------------------------------------
+      //! Read several whole files in one request. Backends which cannot do
+      //! this return -ENOSYS, and the files are then fetched one by one.
+      //!
+      //! @param bufs receives the contents of each file, in the same order
+      //! @return zero on success, a negative errno value on failure
+      //------------------------------------------------------------------------
+      virtual int read_bulk( const std::vector<fuse_ino_t> &inos,
+                             std::vector<std::string>      &bufs )
+      {
+        return -ENOSYS;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return a number naming a file the same way on every node sharing
+      //!         pages, which is what peers are asked for, or zero to never
+      //!         ask peers for the file. The default is the inode number,
+      //!         which is only right if every node numbers files alike.
+      //------------------------------------------------------------------------
+      virtual uint64_t file_id( fuse_ino_t ino )
+      {
+        return ino;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return the inode of the file a peer asks for by file_id(), or zero
+      //!         if this node does not know it
+      //------------------------------------------------------------------------
+      virtual fuse_ino_t file_inode( uint64_t id )
+      {
+        return id;
+      }
+
+      //------------------------------------------------------------------------
+      //! Upload the writes made while the network server was offline. Each
+      //! file is sent as a delta against the version we last saw on the
+      //! server. This is started in the background once status() no longer
+      //! reports OFFLINE, and once more when the filesystem is unmounted,
+      //! but may also be called directly.
+      //!
+      //! @return zero on success, or the first error
+      //------------------------------------------------------------------------
+      int synchronize()
+      {
+        std::lock_guard<std::mutex> sync_lock( sync_mutex );
+        std::vector<std::pair<fuse_ino_t, dirty_t> > work;
+        {
+          std::lock_guard<std::mutex> lock( dirty_mutex );
+          work.assign( dirty.begin(), dirty.end() );
+        }
+
+        int result = 0;
+        for( size_t i = 0; i < work.size(); ++i )
+        {
+          int ret = upload( work[i].first, work[i].second );
+          if( ret < 0 )
+          {
+            statistics.sync_errors++;
+            if( result == 0 ) result = ret;
+            continue;
+          }
+          statistics.synced_files++;
+        }
+        return result;
+      }
+
+      //------------------------------------------------------------------------
+      //! Write the statistics, including small file space overhead
+      //------------------------------------------------------------------------
+      void dump_stats( std::ostream &out )
+      {
+        statistics.dump( out );
+        out << "inode table:  " << inodes.size() << " inodes ("
+            << inodes.memory() << " bytes)" << std::endl;
+
+        slab_store::usage_t u = slabs.usage();
+        out << "slabs:        " << u.files << " files (" << u.payload
+            << " bytes)" << std::endl;
+        if( u.files == 0 ) return;
+
+        out << "  memory overhead: "
+            << ( u.ram_meta + u.ram_slack ) / u.files << " bytes/file ("
+            << u.ram_meta / u.files << " index)" << std::endl
+            << "  disk overhead:   "
+            << ( u.disk_bytes - u.disk_live ) / u.files << " bytes/file"
+            << std::endl;
+      }
+
+      //------------------------------------------------------------------------
+      //! Reply to lookup, mknod, mkdir, symlink or link. The subclass must
+      //! reply through this rather than fuse_reply_entry, so that the lookup
+      //! is counted and the inode's cached state is kept until the kernel
+      //! forgets it. No state is kept for inodes not counted, such as where
+      //! they end, so reads of them stream less well.
+      //------------------------------------------------------------------------
+      static int reply_entry( fuse_req_t req, const struct fuse_entry_param *e )
+      {
+        if( e->ino ) T::self->inodes.lookup( e->ino );
+        int ret = fuse_reply_entry( req, e );
+        if( ret != 0 && e->ino ) T::self->forgotten( e->ino, 1 );
+        return ret;
+      }
+
+      //------------------------------------------------------------------------
+      //! Reply to open. The subclass must reply through this rather than
+      //! fuse_reply_open, so that an open with O_TRUNC cuts what is cached
+      //! of the file, and kept as dirty while the backend is offline, only
+      //! once the open has succeeded. Once a file has been opened for
+      //! reading its start is fetched, and a small file is fetched whole.
+      //------------------------------------------------------------------------
+      static int reply_open( fuse_req_t                   req,
+                             fuse_ino_t                   ino,
+                             const struct fuse_file_info *fi )
+      {
+        if( fi->flags & O_TRUNC ) T::self->truncated( ino, 0 );
+        int ret = fuse_reply_open( req, fi );
+        if( ret == 0 && ( fi->flags & O_ACCMODE ) != O_WRONLY &&
+            !( fi->flags & O_TRUNC ) && T::self->cfg.small_file_size )
+          T::self->fetch_head( ino, T::self->cfg.small_file_size );
+        return ret;
+      }
+
+      //------------------------------------------------------------------------
+      //! Reply to setattr. The subclass must reply through this rather than
+      //! fuse_reply_attr once it has changed the attributes, so that a new
+      //! size cuts what is cached of the file, like an open with O_TRUNC.
+      //!
+      //! @param to_set the attributes which were changed, as passed to
+      //!               setattr
+      //! @param attr   the attributes of the file after the change
+      //------------------------------------------------------------------------
+      static int reply_attr( fuse_req_t         req,
+                             fuse_ino_t         ino,
+                             int                to_set,
+                             const struct stat *attr,
+                             double             attr_timeout )
+      {
+        if( to_set & FUSE_SET_ATTR_SIZE )
+          T::self->truncated( ino, attr->st_size );
+        return fuse_reply_attr( req, attr, attr_timeout );
+      }
+
+      //------------------------------------------------------------------------
+      //! Reply to create, counting the lookup like reply_entry() and cutting
+      //! a file opened with O_TRUNC like reply_open()
+      //------------------------------------------------------------------------
+      static int reply_create( fuse_req_t                     req,
+                               const struct fuse_entry_param *e,
+                               const struct fuse_file_info   *fi )
+      {
+        if( fi->flags & O_TRUNC ) T::self->truncated( e->ino, 0 );
+        T::self->inodes.lookup( e->ino );
+        int ret = fuse_reply_create( req, e, fi );
+        if( ret != 0 ) T::self->forgotten( e->ino, 1 );
+        return ret;
+      }
+
+      config           cfg;
+      fusecache::stats statistics;
 
     public:
       //------------------------------------------------------------------------
@@ -74,6 +465,7 @@ namespace fusecache
       static void init( void *userdata, struct fuse_conn_info *conn )
       {
         std::cout << "init()" << std::endl;
+        T::self->start();
         T::init( userdata, conn );
       }
 
@@ -83,7 +475,9 @@ namespace fusecache
       static void destroy( void *userdata )
       {
         std::cout << "destroy()" << std::endl;
+        T::self->stop();
         T::destroy( userdata );
+        T::self->dump_stats( std::cout );
       }
 
       //------------------------------------------------------------------------
@@ -131,6 +525,7 @@ namespace fusecache
                            struct fuse_file_info *fi )
       {
         std::cout << "readdir()" << std::endl;
+        if( off == 0 ) T::self->listed( ino );
         T::readdir( req, ino, size, off, fi );
       }
 
@@ -227,6 +622,7 @@ namespace fusecache
                         struct fuse_file_info *fi )
       {
         std::cout << "open()" << std::endl;
+        T::self->accessed( req, ino );
         T::open( req, ino, fi );
       }
 
@@ -252,37 +648,20 @@ namespace fusecache
       {
         std::cout << "read()" << std::endl;
 
-        if (T::self->status() == ONLINE)
-        {
-          std::cout << "client online" << std::endl;
-
-          if (T::self->cached.size() != 0)
-          {
-            std::cout << "reading from cache" << std::endl;
-            fuse_reply_buf(req, T::self->cached.c_str(), T::self->cached.size());
-            return;
-          }
-          else
-          {
-            //T::read ( req, ino, size, off, fi );
-            std::cout << "reading from client" << std::endl;
-            int ret = T::self->read( ino, size, off, T::self->cached );
-            fuse_reply_buf( req, T::self->cached.c_str(), T::self->cached.size() );
-            return;
-          }
-        }
+        std::string buf;
+        T::self->check_sync();
+        T::self->accessed( req, ino );
+        int ret = T::self->cached_read( ino, size, off, buf );
+        if( ret < 0 )
+          fuse_reply_err( req, -ret );
         else
-        {
-          std::cout << "client offline" << std::endl;
-          fuse_reply_buf(req, T::self->cached.c_str(), T::self->cached.size());
-          return;
-        }
+          fuse_reply_buf( req, buf.data(), buf.size() );
       }
 
-      virtual int read( fuse_ino_t ino, size_t size, off_t off, std::string &buf ) = 0;
-
       //------------------------------------------------------------------------
-      //! Write function
+      //! Write function. A write which is not kept as dirty pages goes
+      //! through to the subclass, which is expected to have written it to
+      //! the backend by the time it returns.
       //------------------------------------------------------------------------
       static void write( fuse_req_t             req,
                          fuse_ino_t             ino,
@@ -292,7 +671,18 @@ namespace fusecache
                          struct fuse_file_info *fi )
       {
         std::cout << "write()" << std::endl;
-        T::write( req, ino, buf, size, off, fi );
+
+        int ret = T::self->absorb( ino, buf, size, off );
+        if( ret < 0 )
+          fuse_reply_err( req, -ret );
+        else if( ret > 0 )
+          fuse_reply_write( req, size );
+        else
+        {
+          T::self->written( ino, off, size );
+          T::write( req, ino, buf, size, off, fi );
+          T::self->written( ino, off, size );
+        }
       }
 
       //------------------------------------------------------------------------
@@ -324,9 +714,25 @@ namespace fusecache
       static void forget( fuse_req_t req, fuse_ino_t ino, unsigned long nlookup )
       {
         std::cout << "forget()" << std::endl;
+        T::self->forgotten( ino, nlookup );
         T::forget( req, ino, nlookup );
       }
 
+#if FUSE_VERSION >= 29
+      //------------------------------------------------------------------------
+      //! Forget several inodes at once
+      //------------------------------------------------------------------------
+      static void forget_multi( fuse_req_t               req,
+                                size_t                   count,
+                                struct fuse_forget_data *forgets )
+      {
+        std::cout << "forget_multi()" << std::endl;
+        for( size_t i = 0; i < count; ++i )
+          T::self->forgotten( forgets[i].ino, forgets[i].nlookup );
+        T::forget_multi( req, count, forgets );
+      }
+#endif
+
       //------------------------------------------------------------------------
       //! Flush method
       //------------------------------------------------------------------------
@@ -408,6 +814,1485 @@ namespace fusecache
       {
         return llfusexx::fs<fs>::daemonize( argc, argv, self, userdata );
       }
+
+    private:
+      typedef page_cache::clock                          clock;
+      typedef std::chrono::milliseconds                  msec;
+
+      //------------------------------------------------------------------------
+      //! An outstanding backend request for one byte range. The same request
+      //! may be sent more than once when hedging; the first successful answer
+      //! wins and the others are ignored.
+      //------------------------------------------------------------------------
+      struct fetch_t
+      {
+        fetch_t( fuse_ino_t ino, size_t size, off_t off, uint64_t ahead,
+                 uint64_t generation ) :
+          ino( ino ), size( size ), off( off ), ahead( ahead ),
+          generation( generation ), local( false ), speculative( false ),
+          pending( 0 ), attempts( 0 ), started( false ), hedged( false ),
+          done( false ), ret( 0 ), winner( 0 ) {};
+
+        fuse_ino_t              ino;
+        size_t                  size;
+        off_t                   off;
+        uint64_t                ahead;     //!< first page nobody asked for yet
+        uint64_t                generation; //!< write generation when issued
+        bool                    local;     //!< never ask the peers
+        bool                    speculative; //!< nobody is waiting for it
+        std::mutex              mutex;
+        std::condition_variable cond;
+        int                     pending;   //!< requests still outstanding
+        int                     attempts;  //!< requests issued so far
+        bool                    started;   //!< a request has left the queue
+        bool                    hedged;    //!< a reader has hedged already
+        bool                    done;      //!< ret and data are valid
+        int                     ret;
+        int                     winner;    //!< attempt which answered first
+        std::string             data;
+      };
+      typedef std::shared_ptr<fetch_t> fetch_ptr;
+
+      //------------------------------------------------------------------------
+      //! One page of a read: what the cache had, and the fetch to wait for
+      //! if it had nothing usable
+      //------------------------------------------------------------------------
+      struct slot_t
+      {
+        slot_t() : found( false ), stale( false ) {};
+
+        std::string data;
+        bool        found;
+        bool        stale;
+        fetch_ptr   fetch;
+      };
+
+      typedef std::unordered_map<page_cache::key_t, fetch_ptr,
+                                 page_cache::key_hash>     inflight_t;
+
+      //------------------------------------------------------------------------
+      //! Writes through to the backend of the files sharing a slot
+      //------------------------------------------------------------------------
+      struct write_t
+      {
+        std::atomic<uint64_t>   generation; //!< moved on by every write
+        std::atomic<clock::rep> last;       //!< time of the last one, or 0
+      };
+
+      //------------------------------------------------------------------------
+      //! Pages of a file holding writes the backend has not seen yet
+      //------------------------------------------------------------------------
+      struct dirty_t
+      {
+        dirty_t() : size( -1 ), version( 0 ) {};
+
+        std::set<uint64_t> pages;
+        off_t              size;      //!< length of the file if it was
+                                      //!< truncated, or -1
+        uint64_t           version;   //!< bumped by every write
+      };
+      typedef std::unordered_map<fuse_ino_t, dirty_t>      dirty_map_t;
+
+      //------------------------------------------------------------------------
+      //! Apply the configuration and start the backend worker threads
+      //------------------------------------------------------------------------
+      void start()
+      {
+        stats *verify = cfg.verify_pages ? &statistics : 0;
+        cache.configure( cfg.page_size, cfg.cache_pages,
+                         std::chrono::seconds( cfg.page_ttl ), verify );
+        staging.configure( cfg.page_size, cfg.staging_pages,
+                           std::chrono::seconds( cfg.page_ttl ), verify );
+        if( cfg.admission != ADMIT_ALL ) sketch.configure( cfg.cache_pages );
+
+        std::string path = cfg.cache_dir.empty() ? "" : cfg.cache_dir + "/slabs";
+        int ret = slabs.configure( cfg.slab_size, cfg.slab_memory,
+                                   cfg.slab_disk,
+                                   std::chrono::seconds( cfg.page_ttl ), path,
+                                   &statistics );
+        if( ret < 0 )
+          std::cerr << "cannot open slab file " << path << ": "
+                    << strerror( -ret ) << std::endl;
+
+        predictor.configure( cfg.prefetch_model, cfg.prefetch_share,
+                             cfg.prefetch_rate );
+        if( !cfg.cache_dir.empty() )
+          predictor.load( cfg.cache_dir + "/successors" );
+
+        signatures.configure( cfg.page_size, cfg.signatures );
+        if( !cfg.cache_dir.empty() )
+          signatures.load( cfg.cache_dir + "/signatures" );
+
+        ring.configure( cfg.peers );
+        peers.configure( cfg.peers, cfg.peer_timeout );
+        if( cfg.peer_self >= 0 && cfg.peer_self < (int) cfg.peers.size() )
+        {
+          using namespace std::placeholders;
+          ret = server.start( cfg.peers[cfg.peer_self],
+                              std::bind( &fs::serve_range, this,
+                                         _1, _2, _3, _4 ) );
+          if( ret < 0 )
+            std::cerr << "cannot serve peers on " << cfg.peers[cfg.peer_self]
+                      << ": " << strerror( -ret ) << std::endl;
+        }
+
+        size_t threads     = std::max<size_t>( 2, cfg.workers );
+        size_t speculative = cfg.speculative_workers ?
+                             cfg.speculative_workers : threads * 3 / 4;
+        workers.start( threads, std::max<size_t>( 1, std::min(
+                         speculative, threads - 1 ) ) );
+
+        if( !cfg.cache_dir.empty() )
+          load_dirty( cfg.cache_dir + "/dirty" );
+        if( cfg.sync_interval )
+        {
+          watching = true;
+          watcher  = std::thread( &fs::watch, this );
+        }
+      }
+
+      //------------------------------------------------------------------------
+      //! Stop the threads, upload what is left of the writes made offline
+      //! and save what needs to survive a restart. Runs before the subclass
+      //! is destroyed, as the backend is still needed.
+      //------------------------------------------------------------------------
+      void stop()
+      {
+        unwatch();
+        workers.stop();
+        server.stop();
+        drain();
+        if( !cfg.cache_dir.empty() && predictor.size() &&
+            !predictor.save( cfg.cache_dir + "/successors" ) )
+          std::cerr << "cannot save access model in " << cfg.cache_dir
+                    << std::endl;
+        if( !cfg.cache_dir.empty() && signatures.size() &&
+            !signatures.save( cfg.cache_dir + "/signatures" ) )
+          std::cerr << "cannot save block signatures in " << cfg.cache_dir
+                    << std::endl;
+      }
+
+      //------------------------------------------------------------------------
+      //! Feed an access to the prefetcher and start fetching the files it
+      //! expects to be accessed next, as far as the bandwidth budget allows
+      //------------------------------------------------------------------------
+      void accessed( fuse_req_t req, fuse_ino_t ino )
+      {
+        if( cfg.prefetch_rate == 0 ) return;
+        if( predictor.claim( ino ) ) statistics.prefetch_hits++;
+
+        std::vector<fuse_ino_t> next;
+        predictor.observe( fuse_req_ctx( req )->pid, ino, next );
+        if( next.empty() || status() != ONLINE ) return;
+
+        size_t psize = cache.page_size();
+        size_t bytes = std::max( cfg.small_file_size, cfg.prefetch_size );
+        size_t cost  = ( bytes / psize + 1 ) * psize;
+
+        for( size_t i = 0; i < next.size(); ++i )
+        {
+          if( !predictor.allow( cost ) )
+          {
+            statistics.throttled++;
+            continue;
+          }
+          if( !fetch_head( next[i], bytes ) ) continue;
+
+          predictor.issued( next[i], cost );
+          statistics.prefetches++;
+        }
+      }
+
+      //------------------------------------------------------------------------
+      //! Read a byte range through the cache. Missing and stale pages are
+      //! fetched from the backend when it is online, in stripes which are
+      //! fetched in parallel, and sequential readers get the following pages
+      //! fetched in the background. If the backend does not answer before the
+      //! deadline, a stale copy is served when we have one.
+      //!
+      //! @return number of bytes read, or a negative errno value
+      //------------------------------------------------------------------------
+      int cached_read( fuse_ino_t ino, size_t size, off_t off, std::string &out )
+      {
+        size_t psize  = cache.page_size();
+        bool   online = status() == ONLINE;
+
+        statistics.reads++;
+        out.clear();
+        if( size == 0 ) return 0;
+
+        //----------------------------------------------------------------------
+        // A small file is served from its slab, unless the copy there is
+        // stale and the backend is online. It is then fetched like any other
+        // file, with the slab standing in for the pages if the fetch fails.
+        //----------------------------------------------------------------------
+        std::string whole;
+        bool        old   = false;
+        bool        small = slabs.get( ino, whole, old );
+        if( small && ( !old || !online ) )
+        {
+          if( old )
+            statistics.stale_served++;
+          else
+            statistics.hits++;
+          statistics.slab_hits++;
+          if( off < (off_t) whole.size() ) out = whole.substr( off, size );
+          return out.size();
+        }
+
+        uint64_t              first = off / psize;
+        uint64_t              last  = ( off + size - 1 ) / psize;
+        std::vector<slot_t>   slots( last - first + 1 );
+        std::vector<uint64_t> missing;
+
+        for( uint64_t index = first; index <= last; ++index )
+        {
+          page_cache::key_t key( ino, index );
+          slot_t           &slot = slots[index - first];
+
+          if( cfg.admission != ADMIT_ALL )
+            sketch.increment( page_cache::key_hash()( key ) );
+
+          slot.found = cache.get( ino, index, slot.data, slot.stale );
+          if( !slot.found && staging.get( ino, index, slot.data, slot.stale ) )
+          {
+            slot.found = true;
+            staging.erase( ino, index );
+            if( admit( key ) )
+              cache.put( ino, index, slot.data );
+            else
+              statistics.passed_through++;
+          }
+          if( !slot.found && small )
+          {
+            slot.found = true;
+            slot.stale = true;
+            slot.data  = index * psize < whole.size() ?
+                         whole.substr( index * psize, psize ) : "";
+          }
+
+          if( slot.found && !slot.stale )
+            statistics.hits++;
+          else if( online )
+          {
+            statistics.misses++;
+            slot.fetch = pending( ino, index );
+            if( !slot.fetch ) missing.push_back( index );
+          }
+        }
+
+        if( online )
+        {
+          uint64_t until = readahead( ino, off, size );
+          for( uint64_t index = last + 1; index <= until; ++index )
+          {
+            if( cache.fresh( ino, index ) || pending( ino, index ) ) continue;
+            missing.push_back( index );
+            statistics.read_ahead++;
+          }
+          issue( ino, missing, slots, first );
+        }
+
+        for( uint64_t index = first; index <= last; ++index )
+        {
+          slot_t &slot = slots[index - first];
+
+          if( slot.fetch )
+          {
+            int ret = wait( slot.fetch );
+            if( ret == 0 )
+            {
+              size_t pos = index * psize - slot.fetch->off;
+              slot.data  = pos < slot.fetch->data.size() ?
+                           slot.fetch->data.substr( pos, psize ) : "";
+            }
+            else if( !slot.found )
+              return out.empty() ? ret : out.size();
+            else
+              statistics.stale_served++;
+          }
+          else if( !slot.found )
+            return out.empty() ? -EIO : out.size();
+          else if( slot.stale )
+            statistics.stale_served++;
+
+          size_t begin = index == first ? off % psize : 0;
+          if( slot.data.size() <= begin ) break;
+
+          out.append( slot.data, begin, std::min( slot.data.size() - begin,
+                                                  size - out.size() ) );
+          if( slot.data.size() < psize ) break;
+        }
+        return out.size();
+      }
+
+      //------------------------------------------------------------------------
+      //! Note where a read ended, to spot sequential readers
+      //!
+      //! @return index of the last page to read ahead up to, or zero if the
+      //!         read is not part of a sequential stream
+      //------------------------------------------------------------------------
+      uint64_t readahead( fuse_ino_t ino, off_t off, size_t size )
+      {
+        if( cfg.readahead == 0 ) return 0;
+
+        off_t eof;
+        if( !inodes.advance( ino, off, size, eof ) ) return 0;
+
+        off_t end = off + size + cfg.readahead;
+        if( eof >= 0 ) end = std::min( end, eof );
+        if( end <= (off_t) ( off + size ) ) return 0;
+
+        return ( end - 1 ) / cache.page_size();
+      }
+
+      //------------------------------------------------------------------------
+      //! @return the fetch already under way for a page, if there is one
+      //------------------------------------------------------------------------
+      fetch_ptr pending( fuse_ino_t ino, uint64_t index )
+      {
+        std::lock_guard<std::mutex> lock( inflight_mutex );
+        typename inflight_t::iterator it =
+          inflight.find( page_cache::key_t( ino, index ) );
+        return it == inflight.end() ? fetch_ptr() : it->second;
+      }
+
+      //------------------------------------------------------------------------
+      //! Fetch a sorted list of missing pages. Runs of consecutive pages are
+      //! cut into stripes of at most stripe_size bytes, and each stripe is a
+      //! separate backend request so that the stripes are fetched in parallel
+      //! by the worker pool. Stripes holding none of the pages the caller
+      //! waits for are speculative, and queue behind everything else. With
+      //! peers, stripes are also cut at extent() boundaries, so that each one
+      //! goes to a single owner.
+      //!
+      //! Pages another reader has started fetching meanwhile are not fetched
+      //! again: the caller waits for that fetch instead. Checking for them
+      //! and claiming the rest is one step, so that concurrent readers of a
+      //! file never fetch the same page twice.
+      //!
+      //! @param slots slots of the pages the caller is waiting for, starting
+      //!              at page index first
+      //------------------------------------------------------------------------
+      void issue( fuse_ino_t                   ino,
+                  const std::vector<uint64_t> &missing,
+                  std::vector<slot_t>         &slots,
+                  uint64_t                     first )
+      {
+        size_t                 psize   = cache.page_size();
+        size_t                 stripe  = extent() / psize;
+        bool                   aligned = !cfg.peers.empty();
+        std::vector<fetch_ptr> fetches;
+        {
+          std::lock_guard<std::mutex> lock( inflight_mutex );
+          std::vector<uint64_t>       todo;
+          for( size_t i = 0; i < missing.size(); ++i )
+          {
+            typename inflight_t::iterator it =
+              inflight.find( page_cache::key_t( ino, missing[i] ) );
+            if( it == inflight.end() )
+              todo.push_back( missing[i] );
+            else if( missing[i] >= first && missing[i] - first < slots.size() )
+              slots[missing[i] - first].fetch = it->second;
+          }
+
+          for( size_t i = 0, j; i < todo.size(); i = j )
+          {
+            for( j = i + 1; j < todo.size() && j - i < stripe; ++j )
+              if( todo[j] != todo[j - 1] + 1 ||
+                  ( aligned && todo[j] % stripe == 0 ) ) break;
+
+            uint64_t  ahead = std::max( todo[i], first + slots.size() );
+            fetch_ptr f( new fetch_t( ino, ( j - i ) * psize,
+                                      todo[i] * psize, ahead,
+                                      write_generation( ino ) ) );
+            f->speculative = todo[i] >= first + slots.size();
+            f->local       = rewritten( ino );
+            for( size_t k = i; k < j; ++k )
+            {
+              inflight[page_cache::key_t( ino, todo[k] )] = f;
+              if( todo[k] >= first && todo[k] - first < slots.size() )
+                slots[todo[k] - first].fetch = f;
+            }
+            fetches.push_back( f );
+          }
+        }
+
+        for( size_t i = 0; i < fetches.size(); ++i )
+        {
+          statistics.stripes++;
+          launch( fetches[i] );
+        }
+      }
+
+      //------------------------------------------------------------------------
+      //! Send a request for a fetch to the next replica
+      //!
+      //! @param async false to make the request from the calling thread
+      //------------------------------------------------------------------------
+      void launch( fetch_ptr f, bool async = true )
+      {
+        int  attempt;
+        bool background;
+        {
+          std::lock_guard<std::mutex> lock( f->mutex );
+          attempt    = f->attempts++;
+          background = f->speculative;
+          f->pending++;
+        }
+        statistics.fetches++;
+        if( async )
+          workers.submit( std::bind( &fs::complete, this, f, attempt ),
+                          background );
+        else
+          complete( f, attempt );
+      }
+
+      //------------------------------------------------------------------------
+      //! Worker side of a fetch: call the backend, record the answer if it is
+      //! the first one and put it in the cache. The first request of a fetch
+      //! to start goes to the peers when there are any; hedges go to the
+      //! backend. A request which only starts once the fetch is answered is
+      //! dropped.
+      //------------------------------------------------------------------------
+      void complete( fetch_ptr f, int attempt )
+      {
+        std::string       buf;
+        clock::time_point start   = clock::now();
+        int               replica = attempt % std::max( 1, replicas() );
+        int               ret;
+        bool              first;
+
+        {
+          std::lock_guard<std::mutex> lock( f->mutex );
+          first      = !f->started;
+          f->started = true;
+          if( f->done )
+          {
+            f->pending--;
+            return;
+          }
+        }
+
+        if( first && !f->local && !cfg.peers.empty() && file_id( f->ino ) )
+          ret = read_peers( f, buf );
+        else
+          ret = read_replica( f->ino, f->size, f->off, buf, replica );
+        if( ret < 0 )
+          statistics.fetch_errors++;
+        else
+          latency.record( std::chrono::duration_cast<latency_tracker::duration>
+                          ( clock::now() - start ) );
+
+        //----------------------------------------------------------------------
+        // A short answer tells us where the file ends, unless it is empty, as
+        // then the end may be anywhere before the range
+        //----------------------------------------------------------------------
+        if( ret >= 0 && buf.size() < f->size && ( !buf.empty() || !f->off ) )
+          inodes.set_eof( f->ino, f->off + buf.size() );
+
+        {
+          std::lock_guard<std::mutex> lock( f->mutex );
+          f->pending--;
+          if( f->done || ( ret < 0 && f->pending > 0 ) ) return;
+
+          f->done   = true;
+          f->ret    = ret;
+          f->winner = attempt;
+          f->data.swap( buf );
+          f->cond.notify_all();
+        }
+
+        if( !first ) statistics.hedge_wins++;
+        if( ret >= 0 )
+          fill( f->ino, f->off, f->data, f->data.size() < f->size, f->ahead,
+                f->generation );
+
+        size_t psize = cache.page_size();
+        std::lock_guard<std::mutex> lock( inflight_mutex );
+        for( uint64_t index = f->off / psize;
+             index < ( f->off + f->size ) / psize; ++index )
+        {
+          typename inflight_t::iterator it =
+            inflight.find( page_cache::key_t( f->ino, index ) );
+          if( it != inflight.end() && it->second == f ) inflight.erase( it );
+        }
+      }
+
+      //------------------------------------------------------------------------
+      //! Wait for a fetch to complete, hedging once it has taken longer than
+      //! usual and giving up at the deadline. A fetch is hedged once, however
+      //! many readers are waiting for it. A fetch which is given up on keeps
+      //! running and still fills the cache when it completes.
+      //!
+      //! A speculative fetch stops being one when someone waits for it, and if
+      //! it is still queued it is sent again ahead of the background work.
+      //!
+      //! @return zero on success, in which case the fetched bytes are in
+      //!         f->data, or a negative errno value on failure
+      //------------------------------------------------------------------------
+      int wait( fetch_ptr f )
+      {
+        clock::time_point now      = clock::now();
+        clock::time_point never    = clock::time_point::max();
+        clock::time_point deadline = never;
+        clock::time_point hedge_at = never;
+
+        if( cfg.read_timeout )
+          deadline = now + msec( cfg.read_timeout );
+        if( cfg.hedge_percentile > 0 )
+          hedge_at = now + hedge_delay();
+
+        bool promote;
+        {
+          std::lock_guard<std::mutex> lock( f->mutex );
+          promote        = f->speculative && !f->started && !f->done;
+          f->speculative = false;
+        }
+        if( promote ) launch( f );
+
+        std::unique_lock<std::mutex> lock( f->mutex );
+        while( !f->done )
+        {
+          clock::time_point until = std::min( deadline, hedge_at );
+          if( until == never )
+          {
+            f->cond.wait( lock );
+            continue;
+          }
+
+          f->cond.wait_until( lock, until );
+          if( f->done ) break;
+
+          now = clock::now();
+          if( now >= deadline )
+          {
+            statistics.timeouts++;
+            return -ETIMEDOUT;
+          }
+          if( now >= hedge_at )
+          {
+            hedge_at = never;
+            if( f->hedged ) continue;
+
+            f->hedged = true;
+            statistics.hedges++;
+            lock.unlock();
+            launch( f );
+            lock.lock();
+          }
+        }
+        return f->ret < 0 ? f->ret : 0;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return how long to wait for the backend before hedging
+      //------------------------------------------------------------------------
+      clock::duration hedge_delay()
+      {
+        if( latency.count() < 32 ) return msec( cfg.hedge_delay );
+
+        double p = cfg.hedge_percentile;
+        return latency.percentile( p > 1 ? p / 100 : p );
+      }
+
+      //------------------------------------------------------------------------
+      //! @return bytes in a stripe, which is also the extent of a file that
+      //!         one peer owns
+      //------------------------------------------------------------------------
+      size_t extent()
+      {
+        size_t psize = cache.page_size();
+        return std::max<size_t>( 1, cfg.stripe_size / psize ) * psize;
+      }
+
+      //------------------------------------------------------------------------
+      //! Fetch a byte range, which lies within one extent, from the peer
+      //! owning that extent, or from the backend if the peer fails to answer.
+      //! Extents this daemon owns come straight from the backend, as the
+      //! peers would ask us for them.
+      //!
+      //! @return zero on success, a negative errno value on failure
+      //------------------------------------------------------------------------
+      int read_peers( fetch_ptr f, std::string &buf )
+      {
+        size_t   psize = cache.page_size();
+        size_t   pages = ( f->size + psize - 1 ) / psize;
+        uint64_t id    = file_id( f->ino );
+        int      owner = ring.owner( id, f->off / extent() );
+
+        if( owner >= 0 && owner != cfg.peer_self )
+        {
+          int ret = peers.get( owner, id, f->off, f->size, buf );
+          if( ret == 0 )
+          {
+            statistics.peer_hits += ( buf.size() + psize - 1 ) / psize;
+            return 0;
+          }
+          statistics.peer_errors += pages;
+          if( ret == -EBADMSG ) statistics.corrupt++;
+        }
+        return read_replica( f->ino, f->size, f->off, buf, 0 );
+      }
+
+      //------------------------------------------------------------------------
+      //! Peer server side: find a byte range in the cache, or fetch it from
+      //! the backend in one request. The fetch is made from the calling
+      //! thread and never goes to the peers, so that two daemons can never
+      //! end up waiting on each other. Peers asking for the same range at
+      //! once share one fetch.
+      //!
+      //! @param id file_id() of the file
+      //! @return zero on success, a negative errno value on failure
+      //------------------------------------------------------------------------
+      int serve_range( uint64_t     id,
+                       uint64_t     off,
+                       uint32_t     size,
+                       std::string &data )
+      {
+        fuse_ino_t ino = file_inode( id );
+        if( !ino ) return -ENOENT;
+
+        size_t psize = cache.page_size();
+        if( size == 0 || size > extent() || off % psize ) return -EINVAL;
+
+        uint64_t first = off / psize;
+        size_t   pages = ( size + psize - 1 ) / psize;
+        bool     found = !dirtied( ino );
+        bool     stale = false;
+
+        data.clear();
+        for( uint64_t index = first; found && index < first + pages; ++index )
+        {
+          std::string page;
+          bool        old = false;
+          found = cache.get( ino, index, page, old );
+          stale = stale || old;
+          data.append( page );
+          if( found && page.size() < psize ) break;
+        }
+
+        std::string whole;
+        if( !found && slabs.get( ino, whole, stale ) )
+        {
+          found = true;
+          data  = off < whole.size() ? whole.substr( off, size ) : "";
+        }
+
+        if( found && ( !stale || status() != ONLINE ) )
+        {
+          if( data.size() > size ) data.resize( size );
+          statistics.peer_served += pages;
+          return 0;
+        }
+        if( status() != ONLINE ) return -EIO;
+
+        fetch_ptr f;
+        bool      mine = false;
+        {
+          std::lock_guard<std::mutex> lock( inflight_mutex );
+          fetch_ptr &slot = inflight[page_cache::key_t( ino, first )];
+          if( slot && slot->local && slot->off == (off_t) off &&
+              slot->size >= size )
+            f = slot;
+          else
+          {
+            f.reset( new fetch_t( ino, pages * psize, off, first + pages,
+                                  write_generation( ino ) ) );
+            f->local = true;
+            mine     = true;
+            for( uint64_t index = first; index < first + pages; ++index )
+            {
+              fetch_ptr &other = inflight[page_cache::key_t( ino, index )];
+              if( !other ) other = f;
+            }
+          }
+        }
+
+        if( mine )
+        {
+          statistics.misses++;
+          statistics.stripes++;
+          launch( f, false );
+        }
+
+        int ret = wait( f );
+        if( ret < 0 ) return ret;
+
+        data = f->data.substr( 0, size );
+        statistics.peer_served += pages;
+        return 0;
+      }
+
+      //------------------------------------------------------------------------
+      //! Fetch the start of a file in the background. The fetch asks for more
+      //! than the given number of bytes, so if it comes back shorter we have
+      //! the whole file, and if that is small it goes into a slab.
+      //!
+      //! @return true if a fetch was issued, false if it was not needed
+      //------------------------------------------------------------------------
+      bool fetch_head( fuse_ino_t ino, size_t bytes )
+      {
+        if( status() != ONLINE || slabs.fresh( ino ) ) return false;
+
+        std::vector<uint64_t> missing;
+        std::vector<slot_t>   none;
+        for( uint64_t index = 0; index <= bytes / cache.page_size(); ++index )
+        {
+          if( cache.fresh( ino, index ) || pending( ino, index ) ) continue;
+          missing.push_back( index );
+        }
+        if( missing.empty() ) return false;
+
+        issue( ino, missing, none, 0 );
+        return true;
+      }
+
+      //------------------------------------------------------------------------
+      //! Note that a directory has been listed, and fetch its small files in
+      //! bulk once it has been listed often enough to count as hot
+      //------------------------------------------------------------------------
+      void listed( fuse_ino_t dir )
+      {
+        if( cfg.small_file_size == 0 || cfg.hot_dir_reads == 0 ) return;
+
+        uint32_t reads = inodes.listed( dir );
+        if( reads && reads % cfg.hot_dir_reads == 0 )
+          workers.submit( std::bind( &fs::fetch_dir, this, dir ), true );
+      }
+
+      //------------------------------------------------------------------------
+      //! Fetch the small files of a directory which are not cached yet
+      //------------------------------------------------------------------------
+      void fetch_dir( fuse_ino_t dir )
+      {
+        std::vector<std::pair<fuse_ino_t, off_t> > files;
+        if( status() != ONLINE || list_files( dir, files ) < 0 ) return;
+
+        std::vector<fuse_ino_t> batch;
+        size_t                  bytes = 0;
+        for( size_t i = 0; i < files.size(); ++i )
+        {
+          if( files[i].second > (off_t) cfg.small_file_size ) continue;
+          if( slabs.fresh( files[i].first ) ) continue;
+
+          batch.push_back( files[i].first );
+          bytes += files[i].second;
+          if( batch.size() >= cfg.bulk_files || bytes >= cfg.slab_size )
+          {
+            fetch_bulk( batch );
+            batch.clear();
+            bytes = 0;
+          }
+        }
+        if( !batch.empty() ) fetch_bulk( batch );
+      }
+
+      //------------------------------------------------------------------------
+      //! Fetch several small files into slabs in one backend request, or one
+      //! by one if the backend cannot do bulk reads
+      //------------------------------------------------------------------------
+      void fetch_bulk( const std::vector<fuse_ino_t> &inos )
+      {
+        std::vector<uint64_t> generation( inos.size() );
+        for( size_t i = 0; i < inos.size(); ++i )
+          generation[i] = write_generation( inos[i] );
+
+        std::vector<std::string> bufs;
+        int                      ret = read_bulk( inos, bufs );
+
+        if( ret == -ENOSYS )
+        {
+          for( size_t i = 0; i < inos.size(); ++i )
+            fetch_head( inos[i], cfg.small_file_size );
+          return;
+        }
+
+        statistics.fetches++;
+        if( ret < 0 || bufs.size() != inos.size() )
+        {
+          statistics.fetch_errors++;
+          return;
+        }
+
+        statistics.bulk_fetches++;
+        for( size_t i = 0; i < inos.size(); ++i )
+        {
+          if( bufs[i].size() > cfg.small_file_size ||
+              write_generation( inos[i] ) != generation[i] ||
+              dirtied( inos[i] ) || !slabs.put( inos[i], bufs[i] ) )
+            continue;
+
+          statistics.small_files++;
+          if( write_generation( inos[i] ) != generation[i] )
+            slabs.erase( inos[i] );
+        }
+      }
+
+      //------------------------------------------------------------------------
+      //! Cache the result of a fetch. A fetch from the start of a file which
+      //! reached the end of it within small_file_size bytes holds the whole
+      //! file, and goes into a slab unless the file has writes the backend
+      //! has not seen; anything else is split into pages, which leaves the
+      //! dirty ones alone.
+      //!
+      //! Pages already cached are refreshed in place, as nothing needs to be
+      //! evicted for them. Other pages the admission policy turns away are
+      //! not cached; those nobody has asked for yet are staged instead, so
+      //! that the reader they were fetched ahead for can still be served
+      //! from memory.
+      //!
+      //! The answer of a fetch which was issued before the file was last
+      //! written is dropped, as it may hold what was there before. The check
+      //! is repeated once the answer is cached, in case a write came in
+      //! meanwhile.
+      //!
+      //! @param ahead      index of the first page fetched speculatively
+      //! @param generation write generation of the file when the fetch was
+      //!                   issued
+      //------------------------------------------------------------------------
+      void fill( fuse_ino_t         ino,
+                 off_t              off,
+                 const std::string &data,
+                 bool               eof,
+                 uint64_t           ahead,
+                 uint64_t           generation )
+      {
+        if( write_generation( ino ) != generation ) return;
+
+        if( off == 0 && eof && data.size() <= cfg.small_file_size &&
+            !dirtied( ino ) && slabs.put( ino, data ) )
+        {
+          statistics.small_files++;
+          if( write_generation( ino ) != generation ) slabs.erase( ino );
+          return;
+        }
+
+        if( eof && ( !data.empty() || off == 0 ) )
+          signatures.ended( ino, off + data.size() );
+
+        size_t psize = cache.page_size();
+        for( size_t pos = 0; pos < data.size(); pos += psize )
+        {
+          uint64_t    index = ( off + pos ) / psize;
+          std::string page  = data.substr( pos, psize );
+
+          signatures.record( ino, index, page );
+          if( cache.replace( ino, index, page ) ) continue;
+          if( admit( page_cache::key_t( ino, index ) ) )
+            cache.put( ino, index, page );
+          else
+          {
+            statistics.rejected++;
+            if( index >= ahead ) staging.put( ino, index, page );
+          }
+        }
+
+        if( !data.empty() && write_generation( ino ) != generation )
+          discard( ino, off, data.size() );
+      }
+
+      //------------------------------------------------------------------------
+      //! @return the write generation of a file, which every write through to
+      //!         the backend moves on. Files share a fixed number of slots,
+      //!         so a write may also drop the fetches of another file, which
+      //!         only costs a later miss.
+      //------------------------------------------------------------------------
+      std::atomic<uint64_t> &write_generation( fuse_ino_t ino )
+      {
+        return writes[ino % write_slots].generation;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return true if a file was written through from here so recently
+      //!         that the peer owning its pages may still hold what was there
+      //!         before: within page_ttl, or at all if pages never go stale.
+      //!         Its pages are then fetched from the backend.
+      //------------------------------------------------------------------------
+      bool rewritten( fuse_ino_t ino )
+      {
+        clock::rep last = writes[ino % write_slots].last;
+        if( last == 0 ) return false;
+        if( cfg.page_ttl == 0 ) return true;
+
+        return clock::now() - clock::time_point( clock::duration( last ) ) <
+               std::chrono::seconds( cfg.page_ttl );
+      }
+
+      //------------------------------------------------------------------------
+      //! Note a write through to the backend, before and again after it is
+      //! made. Fetches of the file under way are left to finish, but their
+      //! answers are not cached, and reads of the written pages no longer
+      //! wait for them. See also rewritten().
+      //------------------------------------------------------------------------
+      void written( fuse_ino_t ino, off_t off, size_t size )
+      {
+        if( size == 0 ) return;
+
+        write_generation( ino )++;
+        writes[ino % write_slots].last =
+          clock::now().time_since_epoch().count();
+
+        size_t psize = cache.page_size();
+        {
+          std::lock_guard<std::mutex> lock( inflight_mutex );
+          for( uint64_t index = off / psize;
+               index <= ( off + size - 1 ) / psize; ++index )
+            inflight.erase( page_cache::key_t( ino, index ) );
+        }
+        discard( ino, off, size );
+      }
+
+      //------------------------------------------------------------------------
+      //! Forget what is cached of a byte range
+      //------------------------------------------------------------------------
+      void discard( fuse_ino_t ino, off_t off, size_t size )
+      {
+        cache.invalidate( ino, off, size );
+        staging.invalidate( ino, off, size );
+        slabs.erase( ino );
+        signatures.erase( ino, off, size );
+      }
+
+      //------------------------------------------------------------------------
+      //! @return true if a file has writes the backend has not seen yet
+      //------------------------------------------------------------------------
+      bool dirtied( fuse_ino_t ino )
+      {
+        std::lock_guard<std::mutex> lock( dirty_mutex );
+        return dirty.count( ino );
+      }
+
+      //------------------------------------------------------------------------
+      //! @return true if any file has writes the backend has not seen yet
+      //------------------------------------------------------------------------
+      bool dirtied()
+      {
+        std::lock_guard<std::mutex> lock( dirty_mutex );
+        return !dirty.empty();
+      }
+
+      //------------------------------------------------------------------------
+      //! Take back lookups of an inode. Once the kernel has forgotten it, its
+      //! clean pages, packed small file and block signatures are dropped as
+      //! well, since the inode number may be given to another file. Dirty
+      //! pages are kept until they are uploaded, together with the
+      //! signatures they are encoded against.
+      //------------------------------------------------------------------------
+      void forgotten( fuse_ino_t ino, uint64_t nlookup )
+      {
+        if( !inodes.forget( ino, nlookup ) ) return;
+
+        cache.erase( ino );
+        staging.erase( ino );
+        slabs.erase( ino );
+        if( !dirtied( ino ) ) signatures.erase( ino );
+        predictor.claim( ino );
+        statistics.forgotten++;
+      }
+
+      //------------------------------------------------------------------------
+      //! Cut what is cached of a file whose size has been changed. While the
+      //! backend is offline, or the file has writes waiting, the new length
+      //! is kept with the dirty pages and uploaded with them.
+      //------------------------------------------------------------------------
+      void truncated( fuse_ino_t ino, off_t size )
+      {
+        bool online = status() == ONLINE;
+        bool kept   = false;
+        {
+          std::lock_guard<std::mutex> lock( dirty_mutex );
+          if( !online || dirty.count( ino ) )
+          {
+            size_t   psize = cache.page_size();
+            dirty_t &d     = dirty[ino];
+            d.pages.erase( d.pages.lower_bound( ( size + psize - 1 ) / psize ),
+                           d.pages.end() );
+            d.size = size;
+            d.version++;
+            kept = true;
+          }
+          cache.truncate( ino, size );
+        }
+
+        staging.truncate( ino, size );
+        slabs.erase( ino );
+        inodes.set_eof( ino, size );
+
+        //----------------------------------------------------------------------
+        // The signatures describe the backend, which has only been truncated
+        // if the truncation was not kept
+        //----------------------------------------------------------------------
+        if( kept ) return;
+        signatures.erase( ino, size,
+                          std::numeric_limits<off_t>::max() - size );
+        signatures.ended( ino, size );
+      }
+
+      //------------------------------------------------------------------------
+      //! Keep a write in dirty pages if the backend is not online, or if the
+      //! file already has writes waiting to be uploaded, so that they reach
+      //! the backend in order. The rest of a page which is only partly
+      //! written comes from the cache or a fetch under way, or from the
+      //! backend if it is online; if none of them has it the write fails.
+      //!
+      //! @return one if the write was kept, zero if it should go to the
+      //!         backend, or a negative errno value
+      //------------------------------------------------------------------------
+      int absorb( fuse_ino_t ino, const char *buf, size_t size, off_t off )
+      {
+        check_sync();
+        bool online = status() == ONLINE;
+        if( online && !dirtied( ino ) ) return 0;
+        if( size == 0 ) return 1;
+
+        std::string whole;
+        bool        old;
+        bool        small = slabs.get( ino, whole, old );
+        off_t       eof   = small ? (off_t) whole.size() : inodes.eof( ino );
+
+        //----------------------------------------------------------------------
+        // A write past the end of the file fills the gap with zeros
+        //----------------------------------------------------------------------
+        std::string data( buf, size );
+        if( eof >= 0 && eof < off )
+        {
+          data.insert( 0, off - eof, '\0' );
+          off = eof;
+        }
+
+        size_t                   psize = cache.page_size();
+        uint64_t                 first = off / psize;
+        uint64_t                 last  = ( off + data.size() - 1 ) / psize;
+        std::vector<std::string> pages( last - first + 1 );
+
+        for( uint64_t index = first; index <= last; ++index )
+        {
+          std::string &page  = pages[index - first];
+          off_t        start = index * psize;
+          off_t        begin = std::max<off_t>( off, start );
+          off_t        end   = std::min<off_t>( off + data.size(),
+                                                start + psize );
+          off_t        have  = eof < 0 ? start + psize :
+                               std::min<off_t>( eof, start + psize );
+          bool         stale;
+
+          if( small )
+            page = start < eof ? whole.substr( start, psize ) : "";
+          else if( ( ( begin > start && start < have ) || end < have ) &&
+                   !cache.get( ino, index, page, stale ) &&
+                   !fetched( ino, index, page ) &&
+                   ( !online || read( ino, psize, start, page ) < 0 ) )
+            return -EIO;
+
+          if( (off_t) page.size() < end - start ) page.resize( end - start );
+          page.replace( begin - start, end - begin, data, begin - off,
+                        end - begin );
+        }
+
+        {
+          std::lock_guard<std::mutex> lock( dirty_mutex );
+          dirty_t &d = dirty[ino];
+          for( uint64_t index = first; index <= last; ++index )
+          {
+            cache.put_dirty( ino, index, pages[index - first] );
+            staging.erase( ino, index );
+            d.pages.insert( index );
+          }
+          if( d.size >= 0 )
+            d.size = std::max<off_t>( d.size, off + data.size() );
+          d.version++;
+        }
+
+        if( small ) slabs.erase( ino );
+        if( eof >= 0 ) inodes.set_eof( ino, off + data.size(), true );
+
+        statistics.dirty_writes++;
+        return 1;
+      }
+
+      //------------------------------------------------------------------------
+      //! Get a page from the fetch under way for it, if there is one
+      //!
+      //! @return false if there is no fetch or it failed
+      //------------------------------------------------------------------------
+      bool fetched( fuse_ino_t ino, uint64_t index, std::string &data )
+      {
+        fetch_ptr f = pending( ino, index );
+        if( !f || wait( f ) < 0 ) return false;
+
+        size_t pos = index * cache.page_size() - f->off;
+        data = pos < f->data.size() ?
+               f->data.substr( pos, cache.page_size() ) : "";
+        return true;
+      }
+
+      //------------------------------------------------------------------------
+      //! Start uploading the writes kept while offline, in the background,
+      //! once the backend is back
+      //------------------------------------------------------------------------
+      void check_sync()
+      {
+        if( !dirtied() || status() == OFFLINE || syncing.exchange( true ) )
+          return;
+        workers.submit( std::bind( &fs::sync_async, this ), true );
+      }
+
+      //------------------------------------------------------------------------
+      //! Check the backend every sync_interval while writes made offline
+      //! wait, so that they are uploaded as soon as it is back rather than
+      //! on the next read or write
+      //------------------------------------------------------------------------
+      void watch()
+      {
+        std::unique_lock<std::mutex> lock( watch_mutex );
+        while( watching )
+        {
+          watch_cond.wait_for( lock, std::chrono::milliseconds(
+                                       cfg.sync_interval ) );
+          if( !watching ) break;
+
+          lock.unlock();
+          check_sync();
+          lock.lock();
+        }
+      }
+
+      //------------------------------------------------------------------------
+      //! Stop the thread started by watch()
+      //------------------------------------------------------------------------
+      void unwatch()
+      {
+        if( !watcher.joinable() ) return;
+        {
+          std::lock_guard<std::mutex> lock( watch_mutex );
+          watching = false;
+        }
+        watch_cond.notify_all();
+        watcher.join();
+      }
+
+      //------------------------------------------------------------------------
+      //! Upload what is left of the writes made offline before unmounting.
+      //! Whatever the backend does not take is saved in the cache directory
+      //! and picked up by the next start, or reported as lost if there is
+      //! none.
+      //------------------------------------------------------------------------
+      void drain()
+      {
+        if( dirtied() && status() != OFFLINE ) synchronize();
+        if( !dirtied() )
+        {
+          if( !cfg.cache_dir.empty() )
+            ::unlink( ( cfg.cache_dir + "/dirty" ).c_str() );
+          return;
+        }
+
+        size_t files = 0, pages = 0;
+        {
+          std::lock_guard<std::mutex> lock( dirty_mutex );
+          files = dirty.size();
+          for( typename dirty_map_t::iterator it = dirty.begin();
+               it != dirty.end(); ++it )
+            pages += it->second.pages.size();
+        }
+
+        bool saved = !cfg.cache_dir.empty() &&
+                     save_dirty( cfg.cache_dir + "/dirty" );
+        std::cerr << pages << " pages written to " << files << " files "
+                  << "which the backend has not seen "
+                  << ( saved ? "were saved in " + cfg.cache_dir : "are lost" )
+                  << std::endl;
+      }
+
+      //------------------------------------------------------------------------
+      //! Save the dirty pages so that they can be uploaded after a restart.
+      //! Each file is saved with its file_id(), and each page with its
+      //! CRC32C, so that load_dirty() can tell them apart from garbage.
+      //!
+      //! @return false if the file could not be written
+      //------------------------------------------------------------------------
+      bool save_dirty( const std::string &path )
+      {
+        std::string   tmp = path + ".tmp";
+        std::ofstream out( tmp.c_str(), std::ios::binary | std::ios::trunc );
+        {
+          std::lock_guard<std::mutex> lock( dirty_mutex );
+          uint64_t psize = cache.page_size(), count = dirty.size();
+          out.write( "FCD2", 4 );
+          out.write( (const char*) &psize, sizeof( psize ) );
+          out.write( (const char*) &count, sizeof( count ) );
+          for( typename dirty_map_t::iterator it = dirty.begin();
+               it != dirty.end(); ++it )
+          {
+            const std::set<uint64_t> &pages = it->second.pages;
+            uint64_t                  n     = pages.size();
+            uint64_t                  id    = file_id( it->first );
+            int64_t                   size  = it->second.size;
+            out.write( (const char*) &it->first, sizeof( it->first ) );
+            out.write( (const char*) &id, sizeof( id ) );
+            out.write( (const char*) &size, sizeof( size ) );
+            out.write( (const char*) &n, sizeof( n ) );
+            for( std::set<uint64_t>::const_iterator index = pages.begin();
+                 index != pages.end(); ++index )
+            {
+              std::string page;
+              bool        stale;
+              cache.get( it->first, *index, page, stale );
+              uint64_t len = page.size();
+              uint32_t crc = crc32c( page );
+              out.write( (const char*) &*index, sizeof( *index ) );
+              out.write( (const char*) &len, sizeof( len ) );
+              out.write( (const char*) &crc, sizeof( crc ) );
+              out.write( page.data(), page.size() );
+            }
+          }
+        }
+        out.close();
+        return out && ::rename( tmp.c_str(), path.c_str() ) == 0;
+      }
+
+      //------------------------------------------------------------------------
+      //! Load dirty pages saved by save_dirty(), to be uploaded once the
+      //! backend is online. A file whose inode now has another file_id(), or
+      //! with a page failing its checksum, is left out whole, as uploading
+      //! it would write into the wrong file or write garbage.
+      //------------------------------------------------------------------------
+      void load_dirty( const std::string &path )
+      {
+        std::ifstream in( path.c_str(), std::ios::binary );
+        char          magic[4];
+        uint64_t      psize = 0, count = 0;
+        size_t        rejected = 0;
+
+        in.read( magic, sizeof( magic ) );
+        in.read( (char*) &psize, sizeof( psize ) );
+        in.read( (char*) &count, sizeof( count ) );
+        if( !in || std::string( magic, 4 ) != "FCD2" ) return;
+        if( psize != cache.page_size() )
+        {
+          std::cerr << "cannot restore dirty pages from " << path
+                    << ", which were saved with another page size"
+                    << std::endl;
+          return;
+        }
+
+        std::lock_guard<std::mutex> lock( dirty_mutex );
+        for( uint64_t i = 0; i < count && in; ++i )
+        {
+          fuse_ino_t ino;
+          uint64_t   id   = 0;
+          int64_t    size = -1;
+          uint64_t   n    = 0;
+          in.read( (char*) &ino, sizeof( ino ) );
+          in.read( (char*) &id, sizeof( id ) );
+          in.read( (char*) &size, sizeof( size ) );
+          in.read( (char*) &n, sizeof( n ) );
+          if( !in ) break;
+
+          bool ok = id == file_id( ino );
+          std::vector<std::pair<uint64_t, std::string> > pages;
+          for( uint64_t j = 0; j < n && in; ++j )
+          {
+            uint64_t index = 0, len = 0;
+            uint32_t crc   = 0;
+            in.read( (char*) &index, sizeof( index ) );
+            in.read( (char*) &len, sizeof( len ) );
+            in.read( (char*) &crc, sizeof( crc ) );
+            if( len > psize ) in.setstate( std::ios::failbit );
+            if( !in ) break;
+
+            std::string page( len, '\0' );
+            if( len ) in.read( &page[0], len );
+            if( !in ) break;
+
+            ok = ok && crc32c( page ) == crc;
+            if( ok ) pages.push_back( std::make_pair( index, page ) );
+          }
+          if( !in || !ok )
+          {
+            rejected++;
+            continue;
+          }
+
+          dirty_t &d = dirty[ino];
+          d.size = size;
+          d.version++;
+          for( size_t j = 0; j < pages.size(); ++j )
+          {
+            cache.put_dirty( ino, pages[j].first, pages[j].second );
+            d.pages.insert( pages[j].first );
+          }
+        }
+        if( !dirty.empty() )
+          std::cerr << "restored writes to " << dirty.size() << " files from "
+                    << path << std::endl;
+        if( rejected )
+          std::cerr << "dropped writes to " << rejected << " files from "
+                    << path << ", which are damaged or name other files"
+                    << std::endl;
+      }
+
+      void sync_async()
+      {
+        synchronize();
+        syncing = false;
+      }
+
+      //------------------------------------------------------------------------
+      //! Upload the dirty pages of one file. Runs of consecutive pages are
+      //! delta encoded against the signatures of the version on the backend,
+      //! followed by the new length if the file was truncated; if the backend
+      //! cannot take a delta, or refuses it because it holds another version,
+      //! the runs are written whole and the file is then truncated.
+      //!
+      //! Afterwards the signatures describe what the backend now holds, and
+      //! the pages are clean again unless they were written meanwhile.
+      //!
+      //! @return zero on success, a negative errno value on failure
+      //------------------------------------------------------------------------
+      int upload( fuse_ino_t ino, const dirty_t &d )
+      {
+        size_t                                      psize = cache.page_size();
+        std::vector<uint64_t>                       index( d.pages.begin(),
+                                                           d.pages.end() );
+        std::vector<std::pair<off_t, std::string> > runs;
+
+        for( size_t i = 0, j; i < index.size(); i = j )
+        {
+          std::string data;
+          for( j = i; j < index.size(); ++j )
+          {
+            if( j > i && index[j] != index[j - 1] + 1 ) break;
+
+            std::string page;
+            bool        stale;
+            if( !cache.get( ino, index[j], page, stale ) ) return -EIO;
+            data.resize( ( j - i ) * psize );
+            data.append( page );
+          }
+          runs.push_back( std::make_pair( index[i] * psize, data ) );
+        }
+
+        signature_store::blocks_t old;
+        off_t                     length = -1;
+        signatures.get( ino, old, length );
+
+        delta_encoder         encoder( old, psize );
+        std::vector<delta_op> ops;
+        size_t                bytes = 0, sent = 0;
+        off_t                 end   = length;
+        if( length >= 0 )
+        {
+          delta_op op = { delta_op::LENGTH, length, 0, 0, "", 0 };
+          ops.push_back( op );
+        }
+        for( size_t i = 0; i < runs.size(); ++i )
+        {
+          encoder.encode( runs[i].first, runs[i].second, ops );
+          bytes += runs[i].second.size();
+          if( end >= 0 )
+            end = std::max<off_t>( end, runs[i].first +
+                                        runs[i].second.size() );
+        }
+        if( d.size >= 0 )
+        {
+          delta_op op = { delta_op::TRUNCATE, d.size, 0, 0, "", 0 };
+          ops.push_back( op );
+          end = d.size;
+        }
+
+        int ret = ops.empty() ? 0 : write_delta( ino, ops );
+        if( ret == -ESTALE )
+        {
+          statistics.sync_stale++;
+          signatures.erase( ino );
+          end = d.size;
+        }
+        if( ret == -ENOSYS || ret == -ESTALE )
+        {
+          ret = 0;
+          for( size_t i = 0; i < runs.size() && ret == 0; ++i )
+          {
+            ret   = write( ino, runs[i].second, runs[i].first );
+            sent += runs[i].second.size();
+          }
+          if( ret == 0 && d.size >= 0 ) ret = truncate( ino, d.size );
+        }
+        else
+          for( size_t i = 0; i < ops.size(); ++i )
+            if( ops[i].type == delta_op::DATA ) sent += ops[i].len;
+
+        statistics.sync_bytes += sent;
+        statistics.sync_dirty += bytes;
+        if( ret < 0 ) return ret;
+
+        if( d.size >= 0 )
+          signatures.erase( ino, d.size,
+                            std::numeric_limits<off_t>::max() - d.size );
+        for( size_t i = 0; i < runs.size(); ++i )
+          for( size_t pos = 0; pos < runs[i].second.size(); pos += psize )
+            signatures.record( ino, ( runs[i].first + pos ) / psize,
+                               runs[i].second.substr( pos, psize ) );
+        signatures.ended( ino, end );
+
+        std::lock_guard<std::mutex> lock( dirty_mutex );
+        typename dirty_map_t::iterator it = dirty.find( ino );
+        if( it == dirty.end() || it->second.version != d.version ) return 0;
+
+        for( size_t i = 0; i < index.size(); ++i )
+          cache.clean( ino, index[i] );
+        dirty.erase( it );
+        return 0;
+      }
+
+      //------------------------------------------------------------------------
+      //! Ask the admission policy whether a page is worth caching
+      //------------------------------------------------------------------------
+      bool admit( const page_cache::key_t &key )
+      {
+        page_cache::key_t victim;
+        page_cache::key_hash hash;
+
+        switch( cfg.admission )
+        {
+          case ADMIT_SECOND_ACCESS:
+            return sketch.estimate( hash( key ) ) >= 2;
+
+          case ADMIT_TINYLFU:
+            if( !cache.victim( victim ) ) return true;
+            return sketch.estimate( hash( key ) ) >
+                   sketch.estimate( hash( victim ) );
+
+          default:
+            return true;
+        }
+      }
+
+      page_cache                               cache;
+      page_cache                               staging;
+      frequency_sketch                         sketch;
+      thread_pool                              workers;
+      latency_tracker                          latency;
+      std::mutex                               inflight_mutex;
+      inflight_t                               inflight;
+      inode_table                              inodes;
+      slab_store                               slabs;
+      prefetcher                               predictor;
+      signature_store                          signatures;
+      std::mutex                               dirty_mutex;
+      dirty_map_t                              dirty;
+      std::mutex                               sync_mutex;
+      std::atomic<bool>                        syncing;
+      std::thread                              watcher;
+      std::mutex                               watch_mutex;
+      std::condition_variable                  watch_cond;
+      bool                                     watching;
+      hash_ring                                ring;
+      peer_client                              peers;
+      peer_server                              server;
+      static const size_t                      write_slots = 4096;
+      write_t                                  writes[write_slots];
   };
 }
 
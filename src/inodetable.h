@@ -0,0 +1,313 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2012-2013 by European Organization for Nuclear Research (CERN)
+// Author: Justin Salmon <jsalmon@cern.ch>
+//------------------------------------------------------------------------------
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with This program.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#ifndef __FUSECACHE_INODETABLE_HPP__
+#define __FUSECACHE_INODETABLE_HPP__
+
+#include <fuse_lowlevel.h>
+#include <unordered_map>
+#include <algorithm>
+#include <vector>
+#include <mutex>
+#include <stdint.h>
+
+namespace fusecache
+{
+  //----------------------------------------------------------------------------
+  //! The inodes the kernel knows about, with their lookup counts and the
+  //! little state the cache layer keeps per inode.
+  //!
+  //! Every entry handed to the kernel counts as one lookup, and the kernel
+  //! gives them back with forget. Once the count drops to zero the inode can
+  //! only come back through another lookup, so its entry is dropped and the
+  //! caller can drop whatever else it holds for it. Inodes which were never
+  //! counted, because the filesystem replied to the kernel itself, are
+  //! dropped on their first forget.
+  //!
+  //! Only lookups add inodes to the table, and the root, which the kernel
+  //! never looks up or forgets. State noted for any other inode is ignored,
+  //! as nothing would ever remove it again.
+  //!
+  //! The kernel may hold on to tens of millions of inodes, so the entries
+  //! live in one flat array with open addressing and linear probing, at 24
+  //! bytes each. The array doubles once it is 3/4 full and halves once it
+  //! is 3/16 full, so it ends up 3/8 full either way. What only a few
+  //! inodes need at a time is kept on the side: where the last read of a
+  //! file ended, for the files being read now, and how often a directory
+  //! has been listed, for the directories listed so far.
+  //----------------------------------------------------------------------------
+  class inode_table
+  {
+    public:
+      inode_table() : count( 0 ), streams( stream_slots ) {}
+
+      //------------------------------------------------------------------------
+      //! Count lookups of an inode
+      //------------------------------------------------------------------------
+      void lookup( fuse_ino_t ino, uint64_t n = 1 )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        insert( ino )->nlookup += n;
+      }
+
+      //------------------------------------------------------------------------
+      //! Take back lookups of an inode
+      //!
+      //! @return true if none are left, so the inode has been dropped
+      //------------------------------------------------------------------------
+      bool forget( fuse_ino_t ino, uint64_t n )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        entry_t *e = lookup_slot( ino );
+        if( !e ) return true;
+
+        if( e->nlookup > n )
+        {
+          e->nlookup -= n;
+          return false;
+        }
+        erase( e );
+
+        stream_t &s = streams[slot( ino, stream_slots )];
+        if( s.ino == ino ) s = stream_t();
+        dirs.erase( ino );
+        return true;
+      }
+
+      //------------------------------------------------------------------------
+      //! Note where a read ended
+      //!
+      //! @param eof receives the end of the file if known, or -1
+      //! @return true if the read started where the last one ended, or at
+      //!         the start of a file which is not being read yet or is not
+      //!         in the table
+      //------------------------------------------------------------------------
+      bool advance( fuse_ino_t ino, off_t off, size_t size, off_t &eof )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        entry_t *e = find( ino );
+        if( !e )
+        {
+          eof = -1;
+          return off == 0;
+        }
+
+        stream_t &s          = streams[slot( ino, stream_slots )];
+        bool      sequential = off == ( s.ino == ino ? s.next : 0 );
+        s.ino  = ino;
+        s.next = off + size;
+        eof    = e->eof;
+        return sequential;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return the end of a file if known, or -1
+      //------------------------------------------------------------------------
+      off_t eof( fuse_ino_t ino )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        entry_t *e = lookup_slot( ino );
+        return e ? e->eof : -1;
+      }
+
+      //------------------------------------------------------------------------
+      //! Note where a file ends
+      //!
+      //! @param grow only move the end forwards
+      //------------------------------------------------------------------------
+      void set_eof( fuse_ino_t ino, off_t eof, bool grow = false )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        entry_t *e = find( ino );
+        if( e ) e->eof = grow ? std::max( e->eof, eof ) : eof;
+      }
+
+      //------------------------------------------------------------------------
+      //! Note that a directory has been listed
+      //!
+      //! @return number of times it has been listed, or zero if it is not in
+      //!         the table
+      //------------------------------------------------------------------------
+      uint32_t listed( fuse_ino_t dir )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        return find( dir ) ? ++dirs[dir] : 0;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return number of inodes in the table
+      //------------------------------------------------------------------------
+      size_t size()
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        return count;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return approximate bytes of memory the table takes, counting the
+      //!         directories at some 48 bytes each for their hash table nodes
+      //------------------------------------------------------------------------
+      size_t memory()
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        return slots.size() * sizeof( entry_t ) +
+               streams.size() * sizeof( stream_t ) +
+               dirs.size() * 48 + dirs.bucket_count() * sizeof( void* );
+      }
+
+    private:
+      //------------------------------------------------------------------------
+      //! Per-inode state; a slot is free if its inode is zero, which no file
+      //! ever has
+      //------------------------------------------------------------------------
+      struct entry_t
+      {
+        entry_t() : ino( 0 ), nlookup( 0 ), eof( -1 ) {};
+
+        fuse_ino_t ino;
+        uint64_t   nlookup;    //!< lookups the kernel has not forgotten yet
+        off_t      eof;        //!< end of the file if known, or -1
+      };
+
+      //------------------------------------------------------------------------
+      //! Where the last read of a file ended. Files share slots by hash, and
+      //! a file whose slot was taken over reads as not being read yet.
+      //------------------------------------------------------------------------
+      struct stream_t
+      {
+        stream_t() : ino( 0 ), next( 0 ) {};
+
+        fuse_ino_t ino;
+        off_t      next;
+      };
+
+      static const size_t min_slots    = 1024;
+      static const size_t stream_slots = 4096;
+
+      //------------------------------------------------------------------------
+      //! @return home slot of an inode in a table of n slots, a power of two
+      //------------------------------------------------------------------------
+      static size_t slot( fuse_ino_t ino, size_t n )
+      {
+        return ( (uint64_t) ino * 0x9e3779b97f4a7c15ULL >> 32 ) & ( n - 1 );
+      }
+
+      //------------------------------------------------------------------------
+      //! @return the entry of an inode, or null if it is not in the table.
+      //!         Caller holds the lock.
+      //------------------------------------------------------------------------
+      entry_t *lookup_slot( fuse_ino_t ino )
+      {
+        if( slots.empty() ) return 0;
+
+        size_t mask = slots.size() - 1;
+        for( size_t i = slot( ino, slots.size() ); slots[i].ino; )
+        {
+          if( slots[i].ino == ino ) return &slots[i];
+          i = ( i + 1 ) & mask;
+        }
+        return 0;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return the entry of an inode, or null if it is not in the table.
+      //!         The root is added on first use. Caller holds the lock.
+      //------------------------------------------------------------------------
+      entry_t *find( fuse_ino_t ino )
+      {
+        return ino == FUSE_ROOT_ID ? insert( ino ) : lookup_slot( ino );
+      }
+
+      //------------------------------------------------------------------------
+      //! @return the entry of an inode, added if it is not in the table.
+      //!         Caller holds the lock.
+      //------------------------------------------------------------------------
+      entry_t *insert( fuse_ino_t ino )
+      {
+        entry_t *e = lookup_slot( ino );
+        if( e ) return e;
+
+        if( ( count + 1 ) * 4 > slots.size() * 3 )
+          resize( std::max( min_slots, slots.size() * 2 ) );
+
+        size_t mask = slots.size() - 1;
+        size_t i    = slot( ino, slots.size() );
+        while( slots[i].ino ) i = ( i + 1 ) & mask;
+
+        slots[i].ino = ino;
+        count++;
+        return &slots[i];
+      }
+
+      //------------------------------------------------------------------------
+      //! Remove an entry, moving later entries of the same run back so that
+      //! no lookup stops short of them. Caller holds the lock.
+      //------------------------------------------------------------------------
+      void erase( entry_t *e )
+      {
+        size_t mask = slots.size() - 1;
+        size_t hole = e - &slots[0];
+
+        for( size_t i = ( hole + 1 ) & mask; slots[i].ino;
+             i = ( i + 1 ) & mask )
+        {
+          //--------------------------------------------------------------------
+          // The entry may move into the hole if its home slot is not within
+          // the stretch from just after the hole up to where it is now
+          //--------------------------------------------------------------------
+          size_t home = slot( slots[i].ino, slots.size() );
+          if( ( ( i - home ) & mask ) < ( ( i - hole ) & mask ) ) continue;
+
+          slots[hole] = slots[i];
+          hole        = i;
+        }
+        slots[hole] = entry_t();
+        count--;
+
+        if( slots.size() > min_slots && count * 16 < slots.size() * 3 )
+          resize( slots.size() / 2 );
+      }
+
+      //------------------------------------------------------------------------
+      //! Move every entry into a table of n slots. Caller holds the lock.
+      //------------------------------------------------------------------------
+      void resize( size_t n )
+      {
+        std::vector<entry_t> old( n );
+        old.swap( slots );
+
+        size_t mask = n - 1;
+        for( size_t j = 0; j < old.size(); ++j )
+        {
+          if( !old[j].ino ) continue;
+
+          size_t i = slot( old[j].ino, n );
+          while( slots[i].ino ) i = ( i + 1 ) & mask;
+          slots[i] = old[j];
+        }
+      }
+
+      std::mutex                               mutex;
+      std::vector<entry_t>                     slots;
+      size_t                                   count;
+      std::vector<stream_t>                    streams;
+      std::unordered_map<fuse_ino_t, uint32_t> dirs;
+  };
+}
+
+#endif /* __FUSECACHE_INODETABLE_HPP__ */
@@ -0,0 +1,466 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2012-2013 by European Organization for Nuclear Research (CERN)
+// Author: Justin Salmon <jsalmon@cern.ch>
+//------------------------------------------------------------------------------
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with This program.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#ifndef __FUSECACHE_PAGECACHE_HPP__
+#define __FUSECACHE_PAGECACHE_HPP__
+
+#include <fuse_lowlevel.h>
+#include <unordered_map>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <list>
+
+#include "checksum.h"
+#include "stats.h"
+
+namespace fusecache
+{
+  //----------------------------------------------------------------------------
+  //! In-memory cache of fixed-size file pages, keyed by inode and page index,
+  //! with least-recently-used eviction.
+  //!
+  //! A page is stale once it is older than the configured time-to-live or has
+  //! been invalidated by a write. Stale pages are kept, because when the
+  //! backend is slow or offline an old copy is better than no copy at all.
+  //!
+  //! Pages may be stored with a CRC32C which is checked on every hit, in which
+  //! case a corrupt clean page is dropped and reads as a miss. The bytes of a
+  //! page are never changed in place, only replaced, so a hit copies and
+  //! checks them after letting go of the lock.
+  //!
+  //! Dirty pages hold writes the backend has not seen yet. They are pinned:
+  //! they are never stale, never evicted, not counted against the capacity
+  //! and not replaced by clean data, until they are marked clean again.
+  //!
+  //! The pages of each inode are indexed as well, so that all of them can be
+  //! dropped at once without walking the whole cache.
+  //----------------------------------------------------------------------------
+  class page_cache
+  {
+    public:
+      typedef std::chrono::steady_clock clock;
+
+      //------------------------------------------------------------------------
+      //! A page is identified by its inode and its index within the file
+      //------------------------------------------------------------------------
+      typedef std::pair<fuse_ino_t, uint64_t> key_t;
+
+      struct key_hash
+      {
+        size_t operator()( const key_t &key ) const
+        {
+          return std::hash<uint64_t>()( key.first * 0x9e3779b97f4a7c15ULL ^
+                                        key.second );
+        }
+      };
+
+      //------------------------------------------------------------------------
+      //! Constructor
+      //!
+      //! @param page_size size of a page in bytes
+      //! @param capacity  maximum number of pages to keep
+      //! @param ttl       age after which a page is stale, zero for never
+      //------------------------------------------------------------------------
+      page_cache( size_t page_size, size_t capacity,
+                  clock::duration ttl = clock::duration::zero() ) :
+        psize( page_size ), capacity( capacity ), ttl( ttl ), counters( 0 ) {};
+
+      //------------------------------------------------------------------------
+      //! Change the cache geometry. Drops everything that is cached.
+      //!
+      //! @param verify if given, pages are checksummed and verified on every
+      //!               hit, and the checks are counted here
+      //------------------------------------------------------------------------
+      void configure( size_t          page_size,
+                      size_t          capacity,
+                      clock::duration ttl,
+                      stats          *verify = 0 )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        pages.clear();
+        lru.clear();
+        files.clear();
+        this->psize    = page_size;
+        this->capacity = capacity;
+        this->ttl      = ttl;
+        this->counters = verify;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return size of a page in bytes
+      //------------------------------------------------------------------------
+      size_t page_size() const
+      {
+        return psize;
+      }
+
+      //------------------------------------------------------------------------
+      //! Look up a page
+      //!
+      //! @param ino   inode number
+      //! @param index page index within the file
+      //! @param data  receives the page contents
+      //! @param stale set to true if the page is stale
+      //! @return true if the page was found, stale or not
+      //------------------------------------------------------------------------
+      bool get( fuse_ino_t ino, uint64_t index, std::string &data, bool &stale )
+      {
+        bytes_t  bytes;
+        uint32_t crc;
+        bool     check;
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          map_t::iterator it = pages.find( key_t( ino, index ) );
+          if( it == pages.end() ) return false;
+
+          if( !it->second.dirty )
+            lru.splice( lru.begin(), lru, it->second.pos );
+          bytes = it->second.data;
+          crc   = it->second.crc;
+          check = counters && !it->second.dirty;
+          stale = is_stale( it->second );
+        }
+
+        if( !check )
+        {
+          data = *bytes;
+          return true;
+        }
+        if( verify_copy( data, *bytes, crc, counters ) ) return true;
+
+        //----------------------------------------------------------------------
+        // Drop the corrupt page, unless it has been replaced meanwhile
+        //----------------------------------------------------------------------
+        std::lock_guard<std::mutex> lock( mutex );
+        map_t::iterator it = pages.find( key_t( ino, index ) );
+        if( it != pages.end() && it->second.data == bytes ) remove( it );
+        data.clear();
+        return false;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return true if the page is cached and not stale. Does not count as a
+      //!         use of the page.
+      //------------------------------------------------------------------------
+      bool fresh( fuse_ino_t ino, uint64_t index )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        map_t::iterator it = pages.find( key_t( ino, index ) );
+        if( it == pages.end() ) return false;
+
+        return !is_stale( it->second );
+      }
+
+      //------------------------------------------------------------------------
+      //! Insert or replace a page, evicting the least recently used page if
+      //! the cache is full. A dirty page is left alone.
+      //------------------------------------------------------------------------
+      void put( fuse_ino_t ino, uint64_t index, const std::string &data )
+      {
+        uint32_t crc   = counters ? crc32c( data ) : 0;
+        bytes_t  bytes = std::make_shared<const std::string>( data );
+
+        std::lock_guard<std::mutex> lock( mutex );
+        key_t key( ino, index );
+        map_t::iterator it = pages.find( key );
+
+        if( it == pages.end() )
+        {
+          if( capacity == 0 ) return;
+          it = insert( key );
+        }
+        else if( it->second.dirty )
+          return;
+        else
+          lru.splice( lru.begin(), lru, it->second.pos );
+
+        it->second.data    = bytes;
+        it->second.crc     = crc;
+        it->second.fetched = clock::now();
+        it->second.stale   = false;
+      }
+
+      //------------------------------------------------------------------------
+      //! Replace a page which is cached already, stale or not. A dirty page
+      //! is left alone.
+      //!
+      //! @return false if the page is not cached
+      //------------------------------------------------------------------------
+      bool replace( fuse_ino_t ino, uint64_t index, const std::string &data )
+      {
+        uint32_t crc   = counters ? crc32c( data ) : 0;
+        bytes_t  bytes = std::make_shared<const std::string>( data );
+
+        std::lock_guard<std::mutex> lock( mutex );
+        map_t::iterator it = pages.find( key_t( ino, index ) );
+        if( it == pages.end() ) return false;
+        if( it->second.dirty ) return true;
+
+        lru.splice( lru.begin(), lru, it->second.pos );
+        it->second.data    = bytes;
+        it->second.crc     = crc;
+        it->second.fetched = clock::now();
+        it->second.stale   = false;
+        return true;
+      }
+
+      //------------------------------------------------------------------------
+      //! Insert or replace a page holding data not yet written to the backend
+      //------------------------------------------------------------------------
+      void put_dirty( fuse_ino_t ino, uint64_t index, const std::string &data )
+      {
+        bytes_t bytes = std::make_shared<const std::string>( data );
+
+        std::lock_guard<std::mutex> lock( mutex );
+        key_t key( ino, index );
+        map_t::iterator it = pages.find( key );
+
+        if( it == pages.end() )
+        {
+          it = pages.insert( map_t::value_type( key, page_t() ) ).first;
+          link( it );
+        }
+        else if( !it->second.dirty )
+          lru.erase( it->second.pos );
+
+        it->second.data    = bytes;
+        it->second.fetched = clock::now();
+        it->second.stale   = false;
+        it->second.dirty   = true;
+        it->second.pos     = lru.end();
+      }
+
+      //------------------------------------------------------------------------
+      //! Note that a dirty page has been written to the backend, which makes
+      //! it an ordinary page again
+      //------------------------------------------------------------------------
+      void clean( fuse_ino_t ino, uint64_t index )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        key_t key( ino, index );
+        map_t::iterator it = pages.find( key );
+        if( it == pages.end() || !it->second.dirty ) return;
+
+        page_t page;
+        page.data.swap( it->second.data );
+        remove( it );
+        if( capacity == 0 ) return;
+
+        it = insert( key );
+        it->second.data.swap( page.data );
+        it->second.crc     = counters ? crc32c( *it->second.data ) : 0;
+        it->second.fetched = clock::now();
+      }
+
+      //------------------------------------------------------------------------
+      //! Remove a page, unless it is dirty
+      //------------------------------------------------------------------------
+      void erase( fuse_ino_t ino, uint64_t index )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        map_t::iterator it = pages.find( key_t( ino, index ) );
+        if( it == pages.end() || it->second.dirty ) return;
+
+        remove( it );
+      }
+
+      //------------------------------------------------------------------------
+      //! Remove every page of a file, except the dirty ones
+      //------------------------------------------------------------------------
+      void erase( fuse_ino_t ino )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        files_t::iterator f = files.find( ino );
+        if( f == files.end() ) return;
+
+        std::vector<uint64_t> kept;
+        for( size_t i = 0; i < f->second.size(); ++i )
+        {
+          map_t::iterator it = pages.find( key_t( ino, f->second[i] ) );
+          if( it->second.dirty )
+          {
+            it->second.slot = kept.size();
+            kept.push_back( f->second[i] );
+            continue;
+          }
+          lru.erase( it->second.pos );
+          pages.erase( it );
+        }
+
+        if( kept.empty() )
+          files.erase( f );
+        else
+          f->second.swap( kept );
+      }
+
+      //------------------------------------------------------------------------
+      //! Cut a file at a new length: pages past it are removed and the page
+      //! it falls in is shortened, whether they are dirty or not
+      //------------------------------------------------------------------------
+      void truncate( fuse_ino_t ino, off_t size )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        files_t::iterator f = files.find( ino );
+        if( f == files.end() ) return;
+
+        std::vector<uint64_t> indexes( f->second );
+        uint64_t              end = ( size + psize - 1 ) / psize;
+        for( size_t i = 0; i < indexes.size(); ++i )
+        {
+          map_t::iterator it = pages.find( key_t( ino, indexes[i] ) );
+          if( indexes[i] >= end )
+          {
+            remove( it );
+            continue;
+          }
+
+          size_t len = size - indexes[i] * psize;
+          if( it->second.data->size() <= len ) continue;
+          it->second.data = std::make_shared<const std::string>(
+                              *it->second.data, 0, len );
+          if( counters && !it->second.dirty )
+            it->second.crc = crc32c( *it->second.data );
+        }
+      }
+
+      //------------------------------------------------------------------------
+      //! @param key receives the page which the next insertion would evict
+      //! @return false if the cache is not full, so nothing would be evicted
+      //------------------------------------------------------------------------
+      bool victim( key_t &key )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        if( lru.size() < capacity || lru.empty() ) return false;
+
+        key = lru.back();
+        return true;
+      }
+
+      //------------------------------------------------------------------------
+      //! Mark the clean pages overlapping a byte range as stale
+      //------------------------------------------------------------------------
+      void invalidate( fuse_ino_t ino, off_t off, size_t size )
+      {
+        if( size == 0 ) return;
+
+        std::lock_guard<std::mutex> lock( mutex );
+        uint64_t last = ( off + size - 1 ) / psize;
+        for( uint64_t index = off / psize; index <= last; ++index )
+        {
+          map_t::iterator it = pages.find( key_t( ino, index ) );
+          if( it != pages.end() && !it->second.dirty ) it->second.stale = true;
+        }
+      }
+
+      //------------------------------------------------------------------------
+      //! @return number of pages currently cached
+      //------------------------------------------------------------------------
+      size_t size()
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        return pages.size();
+      }
+
+    private:
+      typedef std::shared_ptr<const std::string> bytes_t;
+
+      struct page_t
+      {
+        page_t() : crc( 0 ), stale( false ), dirty( false ), slot( 0 ) {};
+
+        bytes_t                      data;
+        uint32_t                     crc;
+        clock::time_point            fetched;
+        bool                         stale;
+        bool                         dirty;
+        std::list<key_t>::iterator   pos;      //!< lru.end() if dirty
+        size_t                       slot;     //!< position in files[ino]
+      };
+
+      typedef std::unordered_map<key_t, page_t, key_hash>            map_t;
+      typedef std::unordered_map<fuse_ino_t, std::vector<uint64_t> > files_t;
+
+      //------------------------------------------------------------------------
+      //! Add a page to the index of its inode. Caller holds the lock.
+      //------------------------------------------------------------------------
+      void link( map_t::iterator it )
+      {
+        std::vector<uint64_t> &indexes = files[it->first.first];
+        it->second.slot = indexes.size();
+        indexes.push_back( it->first.second );
+      }
+
+      //------------------------------------------------------------------------
+      //! Remove a page, moving the last page of its inode into its slot.
+      //! Caller holds the lock.
+      //------------------------------------------------------------------------
+      void remove( map_t::iterator it )
+      {
+        files_t::iterator      f       = files.find( it->first.first );
+        std::vector<uint64_t> &indexes = f->second;
+        uint64_t               moved   = indexes.back();
+
+        indexes[it->second.slot] = moved;
+        pages.find( key_t( it->first.first, moved ) )->second.slot =
+          it->second.slot;
+        indexes.pop_back();
+        if( indexes.empty() ) files.erase( f );
+
+        if( !it->second.dirty ) lru.erase( it->second.pos );
+        pages.erase( it );
+      }
+
+      //------------------------------------------------------------------------
+      //! Add an empty clean page, evicting to make room. Caller holds the
+      //! lock.
+      //------------------------------------------------------------------------
+      map_t::iterator insert( const key_t &key )
+      {
+        while( !lru.empty() && lru.size() >= capacity )
+          remove( pages.find( lru.back() ) );
+
+        lru.push_front( key );
+        map_t::iterator it =
+          pages.insert( map_t::value_type( key, page_t() ) ).first;
+        it->second.pos = lru.begin();
+        link( it );
+        return it;
+      }
+
+      bool is_stale( const page_t &page ) const
+      {
+        return !page.dirty &&
+               ( page.stale || ( ttl != clock::duration::zero() &&
+                                 clock::now() - page.fetched > ttl ) );
+      }
+
+      std::mutex        mutex;
+      map_t             pages;
+      std::list<key_t>  lru;
+      files_t           files;
+      size_t            psize;
+      size_t            capacity;
+      clock::duration   ttl;
+      stats            *counters;
+  };
+}
+
+#endif /* __FUSECACHE_PAGECACHE_HPP__ */
@@ -0,0 +1,590 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2012-2013 by European Organization for Nuclear Research (CERN)
+// Author: Justin Salmon <jsalmon@cern.ch>
+//------------------------------------------------------------------------------
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with This program.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#ifndef __FUSECACHE_PEER_HPP__
+#define __FUSECACHE_PEER_HPP__
+
+#include <fuse_lowlevel.h>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <list>
+#include <map>
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "checksum.h"
+
+//------------------------------------------------------------------------------
+// Peers talk a trivial request/response protocol over TCP. Every integer is
+// sent most significant byte first.
+//
+//   request:  uint32 magic, uint64 file id, uint64 offset, uint32 length
+//   response: int32 status (zero or an errno value), uint32 length,
+//             uint32 CRC32C of the data, data
+//
+// A request asks for a byte range of a file, and the answer is shorter only
+// at the end of the file. Several requests may be sent on a connection
+// before reading the answers, which come back in the same order. Files are
+// named by an id which every node gives the same file, as inode numbers may
+// differ between nodes.
+//
+// Peers are not authenticated and the traffic is not encrypted: a daemon
+// serves any range it can fetch to whoever connects to it. Only listen on an
+// address which untrusted hosts cannot reach.
+//------------------------------------------------------------------------------
+
+namespace fusecache
+{
+  namespace peer
+  {
+    static const uint32_t magic        = 0x46435034; // "FCP4"
+    static const size_t   request_len  = 24;
+    static const size_t   response_len = 12;
+
+    //--------------------------------------------------------------------------
+    //! Big-endian encoding helpers
+    //--------------------------------------------------------------------------
+    inline void put32( char *p, uint32_t v )
+    {
+      for( int i = 3; i >= 0; --i, v >>= 8 ) p[i] = (char) ( v & 0xff );
+    }
+
+    inline void put64( char *p, uint64_t v )
+    {
+      for( int i = 7; i >= 0; --i, v >>= 8 ) p[i] = (char) ( v & 0xff );
+    }
+
+    inline uint32_t get32( const char *p )
+    {
+      uint32_t v = 0;
+      for( int i = 0; i < 4; ++i ) v = ( v << 8 ) | (unsigned char) p[i];
+      return v;
+    }
+
+    inline uint64_t get64( const char *p )
+    {
+      uint64_t v = 0;
+      for( int i = 0; i < 8; ++i ) v = ( v << 8 ) | (unsigned char) p[i];
+      return v;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Send or receive exactly len bytes
+    //!
+    //! @return false on error, timeout or end of stream
+    //--------------------------------------------------------------------------
+    inline bool send_all( int fd, const char *buf, size_t len )
+    {
+#ifdef MSG_NOSIGNAL
+      int flags = MSG_NOSIGNAL;
+#else
+      int flags = 0;
+#endif
+      while( len )
+      {
+        ssize_t n = ::send( fd, buf, len, flags );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) return false;
+        buf += n;
+        len -= n;
+      }
+      return true;
+    }
+
+    inline bool recv_all( int fd, char *buf, size_t len )
+    {
+      while( len )
+      {
+        ssize_t n = ::recv( fd, buf, len, 0 );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) return false;
+        buf += n;
+        len -= n;
+      }
+      return true;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Split "host:port"
+    //--------------------------------------------------------------------------
+    inline bool split( const std::string &endpoint,
+                       std::string       &host,
+                       std::string       &port )
+    {
+      size_t colon = endpoint.rfind( ':' );
+      if( colon == std::string::npos ) return false;
+
+      host = endpoint.substr( 0, colon );
+      port = endpoint.substr( colon + 1 );
+      return !port.empty();
+    }
+  }
+
+  //----------------------------------------------------------------------------
+  //! Consistent hash ring deciding which peer owns an extent of a file. Each
+  //! peer is put on the ring many times so that extents spread evenly, and
+  //! adding or removing a peer only moves the extents next to it.
+  //----------------------------------------------------------------------------
+  class hash_ring
+  {
+    public:
+      //------------------------------------------------------------------------
+      //! Place the peers on the ring
+      //!
+      //! @param peers  peer names, which must be the same on every node
+      //! @param copies number of points per peer
+      //------------------------------------------------------------------------
+      void configure( const std::vector<std::string> &peers,
+                      size_t                          copies = 128 )
+      {
+        ring.clear();
+        for( size_t p = 0; p < peers.size(); ++p )
+          for( size_t i = 0; i < copies; ++i )
+            ring[hash( peers[p] + "#" + std::to_string( i ) )] = p;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return index of the peer owning an extent of a file, or -1 if there
+      //!         are no peers
+      //------------------------------------------------------------------------
+      int owner( uint64_t id, uint64_t extent ) const
+      {
+        if( ring.empty() ) return -1;
+
+        uint64_t key = ( id * 0xff51afd7ed558ccdULL ) ^ extent;
+        key *= 0x9e3779b97f4a7c15ULL;
+        std::map<uint64_t, size_t>::const_iterator it = ring.lower_bound( key );
+        if( it == ring.end() ) it = ring.begin();
+        return it->second;
+      }
+
+    private:
+      //------------------------------------------------------------------------
+      //! 64-bit FNV-1a
+      //------------------------------------------------------------------------
+      static uint64_t hash( const std::string &s )
+      {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for( size_t i = 0; i < s.size(); ++i )
+          h = ( h ^ (unsigned char) s[i] ) * 0x100000001b3ULL;
+        return h;
+      }
+
+      std::map<uint64_t, size_t> ring;
+  };
+
+  //----------------------------------------------------------------------------
+  //! Fetches byte ranges from other fusecache daemons. Connections are kept
+  //! open between requests, and several threads may ask at once. A peer
+  //! which cannot be reached is left alone for a few seconds before it is
+  //! tried again.
+  //----------------------------------------------------------------------------
+  class peer_client
+  {
+    public:
+      //------------------------------------------------------------------------
+      //! Destructor
+      //------------------------------------------------------------------------
+      ~peer_client()
+      {
+        configure( std::vector<std::string>(), 0 );
+      }
+
+      //------------------------------------------------------------------------
+      //! Set the peer endpoints
+      //!
+      //! @param endpoints "host:port" of each peer
+      //! @param timeout   milliseconds to wait for a peer before giving up
+      //------------------------------------------------------------------------
+      void configure( const std::vector<std::string> &endpoints,
+                      unsigned                        timeout )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        for( size_t p = 0; p < peers.size(); ++p )
+          for( size_t i = 0; i < peers[p].idle.size(); ++i )
+            ::close( peers[p].idle[i] );
+
+        peers.clear();
+        peers.resize( endpoints.size() );
+        for( size_t p = 0; p < endpoints.size(); ++p )
+          peers[p].endpoint = endpoints[p];
+        this->timeout = timeout;
+      }
+
+      //------------------------------------------------------------------------
+      //! Fetch a byte range of a file from one peer
+      //!
+      //! @param id   id of the file, the same on every node
+      //! @param data receives the bytes, shorter than size only at the end of
+      //!             the file
+      //! @return zero on success, a negative errno value on failure, or
+      //!         -EBADMSG if the answer failed its checksum or was longer than
+      //!         asked for, which also ends the connection
+      //------------------------------------------------------------------------
+      int get( size_t       p,
+               uint64_t     id,
+               uint64_t     off,
+               uint32_t     size,
+               std::string &data )
+      {
+        data.clear();
+        int fd = checkout( p );
+        if( fd < 0 ) return -EHOSTUNREACH;
+
+        char req[peer::request_len];
+        peer::put32( req, peer::magic );
+        peer::put64( req + 4, id );
+        peer::put64( req + 12, off );
+        peer::put32( req + 20, size );
+
+        char resp[peer::response_len];
+        int  ret = -EHOSTUNREACH;
+        bool ok  = peer::send_all( fd, req, sizeof( req ) ) &&
+                   peer::recv_all( fd, resp, sizeof( resp ) );
+        if( ok )
+        {
+          int32_t  err = (int32_t) peer::get32( resp );
+          uint32_t len = peer::get32( resp + 4 );
+          uint32_t crc = peer::get32( resp + 8 );
+          if( len > size )
+          {
+            ret = -EBADMSG;
+            ok  = false;
+          }
+          else
+          {
+            data.resize( len );
+            ok = len == 0 || peer::recv_all( fd, &data[0], len );
+            if( ok ) ret = crc32c( data ) == crc ? -err : -EBADMSG;
+          }
+        }
+
+        if( ret < 0 ) data.clear();
+        checkin( p, fd, ok );
+        return ret;
+      }
+
+    private:
+      typedef std::chrono::steady_clock clock;
+
+      struct peer_t
+      {
+        std::string       endpoint;
+        std::vector<int>  idle;       //!< open connections not in use
+        clock::time_point down_until; //!< do not try before this
+      };
+
+      //------------------------------------------------------------------------
+      //! @return an open connection to a peer, or -1
+      //------------------------------------------------------------------------
+      int checkout( size_t p )
+      {
+        std::string endpoint;
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          if( p >= peers.size() || clock::now() < peers[p].down_until )
+            return -1;
+          if( !peers[p].idle.empty() )
+          {
+            int fd = peers[p].idle.back();
+            peers[p].idle.pop_back();
+            return fd;
+          }
+          endpoint = peers[p].endpoint;
+        }
+
+        int fd = connect( endpoint );
+        if( fd < 0 )
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          if( p < peers.size() )
+            peers[p].down_until = clock::now() + std::chrono::seconds( 5 );
+        }
+        return fd;
+      }
+
+      //------------------------------------------------------------------------
+      //! Hand back a connection after use; broken ones are closed
+      //------------------------------------------------------------------------
+      void checkin( size_t p, int fd, bool ok )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        if( ok && p < peers.size() && peers[p].idle.size() < 8 )
+          peers[p].idle.push_back( fd );
+        else
+          ::close( fd );
+      }
+
+      //------------------------------------------------------------------------
+      //! Connect with a timeout
+      //------------------------------------------------------------------------
+      int connect( const std::string &endpoint )
+      {
+        std::string host, port;
+        if( !peer::split( endpoint, host, port ) ) return -1;
+
+        struct addrinfo hints, *res = 0;
+        memset( &hints, 0, sizeof( hints ) );
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if( getaddrinfo( host.c_str(), port.c_str(), &hints, &res ) != 0 )
+          return -1;
+
+        int fd = -1;
+        for( struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next )
+        {
+          fd = ::socket( ai->ai_family, ai->ai_socktype, ai->ai_protocol );
+          if( fd < 0 ) continue;
+
+          int flags = fcntl( fd, F_GETFL );
+          fcntl( fd, F_SETFL, flags | O_NONBLOCK );
+
+          int ret = ::connect( fd, ai->ai_addr, ai->ai_addrlen );
+          if( ret < 0 && errno == EINPROGRESS )
+          {
+            struct pollfd pfd = { fd, POLLOUT, 0 };
+            int       err = 0;
+            socklen_t len = sizeof( err );
+            if( ::poll( &pfd, 1, timeout ) == 1 &&
+                getsockopt( fd, SOL_SOCKET, SO_ERROR, &err, &len ) == 0 )
+              ret = err ? -1 : 0;
+          }
+
+          if( ret < 0 )
+          {
+            ::close( fd );
+            fd = -1;
+            continue;
+          }
+
+          fcntl( fd, F_SETFL, flags );
+          set_timeout( fd );
+        }
+
+        freeaddrinfo( res );
+        return fd;
+      }
+
+      void set_timeout( int fd )
+      {
+        struct timeval tv;
+        tv.tv_sec  = timeout / 1000;
+        tv.tv_usec = ( timeout % 1000 ) * 1000;
+        setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+        setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
+
+        int one = 1;
+        setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+#ifdef SO_NOSIGPIPE
+        setsockopt( fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof( one ) );
+#endif
+      }
+
+      std::mutex          mutex;
+      std::vector<peer_t> peers;
+      unsigned            timeout;
+  };
+
+  //----------------------------------------------------------------------------
+  //! Serves byte ranges to other fusecache daemons. Each connection gets a
+  //! thread, which answers requests in order using the handler.
+  //----------------------------------------------------------------------------
+  class peer_server
+  {
+    public:
+      //------------------------------------------------------------------------
+      //! Fetches a byte range, given by file id, offset and length, for a
+      //! peer
+      //!
+      //! @return zero on success, a negative errno value on failure
+      //------------------------------------------------------------------------
+      typedef std::function<int( uint64_t, uint64_t, uint32_t,
+                                 std::string& )> handler_t;
+
+      peer_server() : listener( -1 ), stopping( false ) {};
+
+      ~peer_server()
+      {
+        stop();
+      }
+
+      //------------------------------------------------------------------------
+      //! Start listening
+      //!
+      //! @param endpoint "host:port" to listen on
+      //! @return zero on success, a negative errno value on failure
+      //------------------------------------------------------------------------
+      int start( const std::string &endpoint, const handler_t &handler )
+      {
+        std::string host, port;
+        if( !peer::split( endpoint, host, port ) ) return -EINVAL;
+
+        struct addrinfo hints, *res = 0;
+        memset( &hints, 0, sizeof( hints ) );
+        hints.ai_family   = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags    = AI_PASSIVE;
+        if( getaddrinfo( host.empty() ? 0 : host.c_str(), port.c_str(),
+                         &hints, &res ) != 0 )
+          return -EINVAL;
+
+        int err = 0;
+        for( struct addrinfo *ai = res; ai && listener < 0; ai = ai->ai_next )
+        {
+          listener = ::socket( ai->ai_family, ai->ai_socktype,
+                               ai->ai_protocol );
+          if( listener < 0 ) continue;
+
+          int one = 1;
+          setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+          if( ::bind( listener, ai->ai_addr, ai->ai_addrlen ) < 0 ||
+              ::listen( listener, 64 ) < 0 )
+          {
+            err = errno;
+            ::close( listener );
+            listener = -1;
+          }
+        }
+        freeaddrinfo( res );
+        if( listener < 0 ) return err ? -err : -EADDRNOTAVAIL;
+
+        this->handler = handler;
+        stopping      = false;
+        acceptor      = std::thread( &peer_server::accept_loop, this );
+        return 0;
+      }
+
+      //------------------------------------------------------------------------
+      //! Stop listening and close every connection
+      //------------------------------------------------------------------------
+      void stop()
+      {
+        if( listener < 0 ) return;
+
+        stopping = true;
+        acceptor.join();
+        ::close( listener );
+        listener = -1;
+
+        std::lock_guard<std::mutex> lock( mutex );
+        for( conns_t::iterator it = conns.begin(); it != conns.end(); ++it )
+        {
+          ::shutdown( ( *it )->fd, SHUT_RDWR );
+          ( *it )->thread.join();
+          ::close( ( *it )->fd );
+        }
+        conns.clear();
+      }
+
+    private:
+      struct conn_t
+      {
+        int               fd;
+        std::thread       thread;
+        std::atomic<bool> done;
+      };
+      typedef std::list<std::shared_ptr<conn_t> > conns_t;
+
+      //------------------------------------------------------------------------
+      //! Accept connections until stopped, reaping finished ones as we go
+      //------------------------------------------------------------------------
+      void accept_loop()
+      {
+        while( !stopping )
+        {
+          struct pollfd pfd = { listener, POLLIN, 0 };
+          if( ::poll( &pfd, 1, 200 ) != 1 ) continue;
+
+          int fd = ::accept( listener, 0, 0 );
+          if( fd < 0 ) continue;
+
+          int one = 1;
+          setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+#ifdef SO_NOSIGPIPE
+          setsockopt( fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof( one ) );
+#endif
+
+          std::lock_guard<std::mutex> lock( mutex );
+          for( conns_t::iterator it = conns.begin(); it != conns.end(); )
+          {
+            if( !( *it )->done ) { ++it; continue; }
+            ( *it )->thread.join();
+            ::close( ( *it )->fd );
+            it = conns.erase( it );
+          }
+
+          std::shared_ptr<conn_t> conn( new conn_t );
+          conn->fd     = fd;
+          conn->done   = false;
+          conn->thread = std::thread( &peer_server::serve, this, conn.get() );
+          conns.push_back( conn );
+        }
+      }
+
+      //------------------------------------------------------------------------
+      //! Answer requests on one connection until it is closed
+      //------------------------------------------------------------------------
+      void serve( conn_t *conn )
+      {
+        char req[peer::request_len];
+        while( peer::recv_all( conn->fd, req, sizeof( req ) ) )
+        {
+          if( peer::get32( req ) != peer::magic ) break;
+
+          std::string data;
+          int  ret = handler( peer::get64( req + 4 ), peer::get64( req + 12 ),
+                              peer::get32( req + 20 ), data );
+          char resp[peer::response_len];
+          if( ret < 0 ) data.clear();
+          peer::put32( resp, ret < 0 ? -ret : 0 );
+          peer::put32( resp + 4, data.size() );
+          peer::put32( resp + 8, crc32c( data ) );
+
+          if( !peer::send_all( conn->fd, resp, sizeof( resp ) ) ||
+              !peer::send_all( conn->fd, data.data(), data.size() ) )
+            break;
+        }
+        conn->done = true;
+      }
+
+      int               listener;
+      std::atomic<bool> stopping;
+      std::thread       acceptor;
+      handler_t         handler;
+      std::mutex        mutex;
+      conns_t           conns;
+  };
+}
+
+#endif /* __FUSECACHE_PEER_HPP__ */
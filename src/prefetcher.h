@@ -0,0 +1,308 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2012-2013 by European Organization for Nuclear Research (CERN)
+// Author: Justin Salmon <jsalmon@cern.ch>
+//------------------------------------------------------------------------------
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with This program.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#ifndef __FUSECACHE_PREFETCHER_HPP__
+#define __FUSECACHE_PREFETCHER_HPP__
+
+#include <fuse_lowlevel.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <fstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdio>
+#include <stdint.h>
+
+namespace fusecache
+{
+  //----------------------------------------------------------------------------
+  //! Learns which file a process tends to open after which, and predicts the
+  //! next files so that they can be fetched before they are asked for.
+  //!
+  //! For every inode we remember up to four successors with a use count,
+  //! and when a transition out of it was last seen, which is 48 bytes per
+  //! inode plus the hash table entry. A successor is predicted once it has
+  //! been seen at least twice and makes up a large enough share of what has
+  //! followed the inode. Once the model is full, a new inode takes the place
+  //! of the least recently seen of a few inodes picked at random, so that
+  //! the model keeps following what is being accessed now.
+  //!
+  //! Speculative fetches are paid for from a token bucket so that a run of
+  //! bad predictions cannot take more than a set share of the bandwidth.
+  //----------------------------------------------------------------------------
+  class prefetcher
+  {
+    public:
+      //------------------------------------------------------------------------
+      //! Constructor
+      //------------------------------------------------------------------------
+      prefetcher() : capacity( 0 ), confidence( 1 ), rate( 0 ), tokens( 0 ),
+                     refilled( clock::now() ), tick( 0 ) {};
+
+      //------------------------------------------------------------------------
+      //! Set the model limits
+      //!
+      //! @param capacity   most inodes to keep successors for
+      //! @param confidence share of the transitions out of an inode which a
+      //!                   successor needs before it is predicted
+      //! @param rate       speculative fetch budget in bytes per second
+      //------------------------------------------------------------------------
+      void configure( size_t capacity, double confidence, size_t rate )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        this->capacity   = capacity;
+        this->confidence = confidence;
+        this->rate       = rate;
+        this->tokens     = rate;
+      }
+
+      //------------------------------------------------------------------------
+      //! Record that a process has accessed an inode
+      //!
+      //! @param pid  process making the access
+      //! @param ino  inode accessed
+      //! @param next receives the inodes likely to be accessed next; left
+      //!             empty if the process was already on this inode
+      //------------------------------------------------------------------------
+      void observe( pid_t pid, fuse_ino_t ino, std::vector<fuse_ino_t> &next )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        last_t::iterator it = last.find( pid );
+        if( it != last.end() )
+        {
+          if( it->second == ino ) return;
+          learn( it->second, ino );
+          it->second = ino;
+        }
+        else
+        {
+          if( last.size() >= 4096 ) last.clear();
+          last[pid] = ino;
+        }
+
+        model_t::iterator m = model.find( ino );
+        if( m == model.end() ) return;
+
+        unsigned total = 0;
+        for( size_t i = 0; i < ways; ++i ) total += m->second.count[i];
+        for( size_t i = 0; i < ways; ++i )
+          if( m->second.count[i] >= 2 &&
+              m->second.count[i] >= confidence * total )
+            next.push_back( m->second.ino[i] );
+      }
+
+      //------------------------------------------------------------------------
+      //! @return true if there is room in the budget for a speculative fetch
+      //------------------------------------------------------------------------
+      bool allow( size_t bytes )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        clock::time_point now = clock::now();
+        double elapsed = std::chrono::duration<double>( now - refilled ).count();
+
+        tokens   = std::min<double>( rate, tokens + elapsed * rate );
+        refilled = now;
+        return tokens >= bytes;
+      }
+
+      //------------------------------------------------------------------------
+      //! Note that a speculative fetch has been made
+      //------------------------------------------------------------------------
+      void issued( fuse_ino_t ino, size_t bytes )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        tokens -= bytes;
+        if( prefetched.size() >= 65536 ) prefetched.clear();
+        prefetched.insert( ino );
+      }
+
+      //------------------------------------------------------------------------
+      //! @return true if an inode being accessed was fetched speculatively,
+      //!         which is only reported once per fetch
+      //------------------------------------------------------------------------
+      bool claim( fuse_ino_t ino )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        return prefetched.erase( ino );
+      }
+
+      //------------------------------------------------------------------------
+      //! Load a model saved by save(). A missing or unreadable file leaves
+      //! the model empty, and a model too large for the capacity keeps the
+      //! inodes seen last.
+      //------------------------------------------------------------------------
+      void load( const std::string &path )
+      {
+        std::ifstream in( path.c_str(), std::ios::binary );
+        char          magic[4];
+        uint64_t      count = 0;
+
+        in.read( magic, sizeof( magic ) );
+        in.read( (char*) &count, sizeof( count ) );
+        if( !in || std::string( magic, 4 ) != "FCM2" ) return;
+
+        std::lock_guard<std::mutex> lock( mutex );
+        model.clear();
+        in.read( (char*) &tick, sizeof( tick ) );
+        for( uint64_t i = 0; i < count && in; ++i )
+        {
+          fuse_ino_t src;
+          succ_t     succ;
+          in.read( (char*) &src, sizeof( src ) );
+          in.read( (char*) &succ, sizeof( succ ) );
+          if( !in || capacity == 0 ) break;
+          if( model.size() >= capacity ) evict();
+          model[src] = succ;
+        }
+      }
+
+      //------------------------------------------------------------------------
+      //! Save the model so that it survives a restart
+      //!
+      //! @return false if the file could not be written
+      //------------------------------------------------------------------------
+      bool save( const std::string &path )
+      {
+        std::string   tmp = path + ".tmp";
+        std::ofstream out( tmp.c_str(), std::ios::binary | std::ios::trunc );
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          uint64_t count = model.size();
+          out.write( "FCM2", 4 );
+          out.write( (const char*) &count, sizeof( count ) );
+          out.write( (const char*) &tick, sizeof( tick ) );
+          for( model_t::iterator it = model.begin(); it != model.end(); ++it )
+          {
+            out.write( (const char*) &it->first, sizeof( it->first ) );
+            out.write( (const char*) &it->second, sizeof( it->second ) );
+          }
+        }
+        out.close();
+        return out && ::rename( tmp.c_str(), path.c_str() ) == 0;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return number of inodes with known successors
+      //------------------------------------------------------------------------
+      size_t size()
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        return model.size();
+      }
+
+    private:
+      typedef std::chrono::steady_clock clock;
+
+      static const size_t ways    = 4;
+      static const size_t samples = 8;
+
+      struct succ_t
+      {
+        fuse_ino_t ino[ways];
+        uint16_t   count[ways];
+        uint32_t   seen;       //!< tick of the last transition out of it
+      };
+
+      typedef std::unordered_map<fuse_ino_t, succ_t> model_t;
+      typedef std::unordered_map<pid_t, fuse_ino_t>  last_t;
+
+      //------------------------------------------------------------------------
+      //! Count a transition. An unknown successor replaces the least used
+      //! one. Caller holds the lock.
+      //------------------------------------------------------------------------
+      void learn( fuse_ino_t from, fuse_ino_t to )
+      {
+        if( capacity == 0 ) return;
+
+        tick++;
+        model_t::iterator it = model.find( from );
+        if( it == model.end() )
+        {
+          if( model.size() >= capacity ) evict();
+          it = model.insert( model_t::value_type( from, succ_t() ) ).first;
+        }
+
+        succ_t &s    = it->second;
+        size_t  slot = 0;
+        s.seen = tick;
+        for( size_t i = 0; i < ways; ++i )
+        {
+          if( s.count[i] && s.ino[i] == to )
+          {
+            slot = i;
+            break;
+          }
+          if( s.count[i] < s.count[slot] ) slot = i;
+        }
+
+        if( s.count[slot] == 0 || s.ino[slot] != to )
+        {
+          s.ino[slot]   = to;
+          s.count[slot] = 0;
+        }
+
+        if( ++s.count[slot] == UINT16_MAX )
+          for( size_t i = 0; i < ways; ++i ) s.count[i] /= 2;
+      }
+
+      //------------------------------------------------------------------------
+      //! Drop the least recently seen of a few inodes, taken from the buckets
+      //! following a random one. Caller holds the lock.
+      //------------------------------------------------------------------------
+      void evict()
+      {
+        size_t     buckets = model.bucket_count();
+        size_t     b       = ( tick * 0x9e3779b97f4a7c15ULL >> 32 ) % buckets;
+        size_t     n       = 0;
+        uint32_t   oldest  = 0;
+        fuse_ino_t victim  = 0;
+        bool       found   = false;
+
+        for( size_t i = 0; i < buckets && n < samples; ++i )
+        {
+          for( model_t::local_iterator it = model.begin( b );
+               it != model.end( b ) && n < samples; ++it, ++n )
+          {
+            uint32_t age = tick - it->second.seen;
+            if( found && age < oldest ) continue;
+            oldest = age;
+            victim = it->first;
+            found  = true;
+          }
+          b = ( b + 1 ) % buckets;
+        }
+        if( found ) model.erase( victim );
+      }
+
+      std::mutex                     mutex;
+      model_t                        model;
+      last_t                         last;
+      std::unordered_set<fuse_ino_t> prefetched;
+      size_t                         capacity;
+      double                         confidence;
+      size_t                         rate;
+      double                         tokens;
+      clock::time_point              refilled;
+      uint32_t                       tick;     //!< transitions learnt so far
+  };
+}
+
+#endif /* __FUSECACHE_PREFETCHER_HPP__ */
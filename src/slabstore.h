@@ -0,0 +1,388 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2012-2013 by European Organization for Nuclear Research (CERN)
+// Author: Justin Salmon <jsalmon@cern.ch>
+//------------------------------------------------------------------------------
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with This program.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#ifndef __FUSECACHE_SLABSTORE_HPP__
+#define __FUSECACHE_SLABSTORE_HPP__
+
+#include <fuse_lowlevel.h>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <map>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "stats.h"
+
+namespace fusecache
+{
+  //----------------------------------------------------------------------------
+  //! Store for whole small files, packed back to back into large slabs so
+  //! that a file of a few hundred bytes costs a few hundred bytes and not a
+  //! whole cache page.
+  //!
+  //! New files are appended to the open slab. Full slabs are written to a
+  //! slab file on disk, which is used as a ring: when it wraps, the files in
+  //! the slab being overwritten are forgotten. The most recent slabs are also
+  //! kept in memory. Without a slab file, files are forgotten as soon as
+  //! their slab drops out of memory.
+  //!
+  //! Every file is stored with a CRC32C, which is checked whenever it is read
+  //! back from the slab file; a file which fails the check is forgotten.
+  //!
+  //! Like a cache page, a file is stale once it is older than the configured
+  //! time-to-live, and a stale file is still returned, for when the backend
+  //! cannot be reached.
+  //!
+  //! The slab file is scratch space, it is not read back after a restart.
+  //----------------------------------------------------------------------------
+  class slab_store
+  {
+    public:
+      typedef std::chrono::steady_clock clock;
+
+      //------------------------------------------------------------------------
+      //! Space accounting, used to report the per-file overhead
+      //------------------------------------------------------------------------
+      struct usage_t
+      {
+        size_t files;       //!< files stored
+        size_t payload;     //!< bytes of file data stored
+        size_t ram_meta;    //!< bytes of index kept in memory
+        size_t ram_slack;   //!< bytes of memory slabs not holding live data
+        size_t disk_bytes;  //!< bytes of slab file in use
+        size_t disk_live;   //!< bytes of slab file holding live data
+      };
+
+      //------------------------------------------------------------------------
+      //! Constructor
+      //------------------------------------------------------------------------
+      slab_store() : slab_size( 1024 * 1024 ), mem_slabs( 1 ), disk_slabs( 0 ),
+                     ttl( 0 ), fd( -1 ), next( 0 ), counters( 0 ) {};
+
+      //------------------------------------------------------------------------
+      //! Destructor
+      //------------------------------------------------------------------------
+      ~slab_store()
+      {
+        if( fd >= 0 ) ::close( fd );
+      }
+
+      //------------------------------------------------------------------------
+      //! Set the slab geometry and open the slab file. Drops everything that
+      //! is stored.
+      //!
+      //! @param slab_size  size of a slab, and so of the largest file, in bytes
+      //! @param mem_slabs  number of slabs to keep in memory
+      //! @param disk_slabs number of slabs in the slab file
+      //! @param ttl        age after which a file is stale, zero for never
+      //! @param path       slab file, or empty to keep slabs in memory only
+      //! @param counters   if given, checksum checks are counted here
+      //! @return zero on success, a negative errno value on failure
+      //------------------------------------------------------------------------
+      int configure( size_t               slab_size,
+                     size_t               mem_slabs,
+                     size_t               disk_slabs,
+                     std::chrono::seconds ttl,
+                     const std::string   &path,
+                     stats               *counters = 0 )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        this->counters = counters;
+        this->ttl      = ttl.count();
+        this->epoch    = clock::now();
+        index.clear();
+        slabs.clear();
+        if( fd >= 0 ) ::close( fd );
+
+        this->slab_size  = slab_size;
+        this->mem_slabs  = std::max<size_t>( 1, mem_slabs );
+        this->disk_slabs = 0;
+        this->fd         = -1;
+
+        if( path.empty() || disk_slabs == 0 ) return 0;
+
+        fd = ::open( path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600 );
+        if( fd < 0 ) return -errno;
+        this->disk_slabs = disk_slabs;
+        return 0;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return size of the largest file which can be stored
+      //------------------------------------------------------------------------
+      size_t max_file_size() const
+      {
+        return slab_size;
+      }
+
+      //------------------------------------------------------------------------
+      //! Store a whole file, replacing any previous copy
+      //!
+      //! @return false if the file is too big for a slab
+      //------------------------------------------------------------------------
+      bool put( fuse_ino_t ino, const std::string &data )
+      {
+        if( data.size() > slab_size ) return false;
+
+        uint32_t crc = crc32c( data );
+        std::lock_guard<std::mutex> lock( mutex );
+        drop( ino );
+
+        if( slabs.empty() ||
+            slabs.rbegin()->second.data.size() + data.size() > slab_size )
+          open_slab();
+
+        uint32_t id   = slabs.rbegin()->first;
+        slab_t  &slab = slabs.rbegin()->second;
+        entry_t  e    = { id, (uint32_t) slab.data.size(),
+                          (uint32_t) data.size(), crc, now() };
+
+        slab.data.append( data );
+        slab.live += data.size();
+        slab.inos.push_back( ino );
+        index[ino] = e;
+        return true;
+      }
+
+      //------------------------------------------------------------------------
+      //! Fetch a whole file, from memory or from the slab file
+      //!
+      //! @param stale set to true if the file is stale
+      //! @return true if the file was found intact, stale or not
+      //------------------------------------------------------------------------
+      bool get( fuse_ino_t ino, std::string &data, bool &stale )
+      {
+        entry_t e;
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          index_t::iterator it = index.find( ino );
+          if( it == index.end() ) return false;
+
+          e     = it->second;
+          stale = is_stale( e );
+          slab_t &slab = slabs.find( e.slab )->second;
+          if( slab.resident )
+          {
+            data.assign( slab.data, e.off, e.len );
+            return true;
+          }
+        }
+
+        //----------------------------------------------------------------------
+        // Read from disk without holding the lock. The ring may wrap over the
+        // slab meanwhile, in which case the entry is gone when we check again.
+        //----------------------------------------------------------------------
+        data.resize( e.len );
+        off_t   pos = (off_t) ( e.slab % disk_slabs ) * slab_size + e.off;
+        ssize_t ret = e.len ? ::pread( fd, &data[0], e.len, pos ) : 0;
+
+        bool ok = ret == (ssize_t) e.len && verify_checksum( data, e.crc,
+                                                             counters );
+
+        std::lock_guard<std::mutex> lock( mutex );
+        index_t::iterator it = index.find( ino );
+        if( it == index.end() || it->second.slab != e.slab ||
+            it->second.off != e.off )
+          return false;
+
+        if( !ok ) drop( ino );
+        return ok;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return true if a file is stored and not stale
+      //------------------------------------------------------------------------
+      bool fresh( fuse_ino_t ino )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        index_t::iterator it = index.find( ino );
+        return it != index.end() && !is_stale( it->second );
+      }
+
+      //------------------------------------------------------------------------
+      //! Forget a file. Its bytes stay in the slab until the slab is dropped.
+      //------------------------------------------------------------------------
+      void erase( fuse_ino_t ino )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        drop( ino );
+      }
+
+      //------------------------------------------------------------------------
+      //! @return current space accounting
+      //------------------------------------------------------------------------
+      usage_t usage()
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        usage_t u = usage_t();
+        u.files    = index.size();
+        u.ram_meta = index.size() * ( sizeof( index_t::value_type ) +
+                                      2 * sizeof( void* ) );
+
+        for( slabs_t::iterator it = slabs.begin(); it != slabs.end(); ++it )
+        {
+          slab_t &slab = it->second;
+          u.payload  += slab.live;
+          u.ram_meta += slab.inos.size() * sizeof( fuse_ino_t );
+          if( slab.resident )
+            u.ram_slack += slab.data.capacity() - slab.live;
+          if( slab.on_disk )
+          {
+            u.disk_bytes += slab_size;
+            u.disk_live  += slab.live;
+          }
+        }
+        return u;
+      }
+
+    private:
+      //------------------------------------------------------------------------
+      //! Where a file lives: 20 bytes per file
+      //------------------------------------------------------------------------
+      struct entry_t
+      {
+        uint32_t slab;
+        uint32_t off;
+        uint32_t len;
+        uint32_t crc;
+        uint32_t fetched;  //!< seconds after configure() it was stored
+      };
+
+      struct slab_t
+      {
+        slab_t() : live( 0 ), resident( true ), on_disk( false ) {};
+
+        std::string             data;      //!< empty unless resident
+        size_t                  live;      //!< bytes still indexed
+        bool                    resident;
+        bool                    on_disk;
+        std::vector<fuse_ino_t> inos;      //!< files put in this slab
+      };
+
+      typedef std::unordered_map<fuse_ino_t, entry_t> index_t;
+      typedef std::map<uint32_t, slab_t>              slabs_t;
+
+      //------------------------------------------------------------------------
+      //! @return seconds since configure()
+      //------------------------------------------------------------------------
+      uint32_t now() const
+      {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+                 clock::now() - epoch ).count();
+      }
+
+      bool is_stale( const entry_t &e ) const
+      {
+        return ttl && now() - e.fetched > ttl;
+      }
+
+      //------------------------------------------------------------------------
+      //! Remove a file from the index. Caller holds the lock.
+      //------------------------------------------------------------------------
+      void drop( fuse_ino_t ino )
+      {
+        index_t::iterator it = index.find( ino );
+        if( it == index.end() ) return;
+
+        slabs[it->second.slab].live -= it->second.len;
+        index.erase( it );
+      }
+
+      //------------------------------------------------------------------------
+      //! Forget a slab and every file still in it. Caller holds the lock.
+      //------------------------------------------------------------------------
+      void drop_slab( uint32_t id )
+      {
+        slabs_t::iterator s = slabs.find( id );
+        if( s == slabs.end() ) return;
+
+        for( size_t i = 0; i < s->second.inos.size(); ++i )
+        {
+          index_t::iterator it = index.find( s->second.inos[i] );
+          if( it != index.end() && it->second.slab == id ) index.erase( it );
+        }
+        slabs.erase( s );
+      }
+
+      //------------------------------------------------------------------------
+      //! Seal the open slab, writing it to disk, and start a new one. Caller
+      //! holds the lock.
+      //------------------------------------------------------------------------
+      void open_slab()
+      {
+        if( !slabs.empty() && fd >= 0 )
+        {
+          uint32_t id   = slabs.rbegin()->first;
+          slab_t  &slab = slabs.rbegin()->second;
+
+          if( id >= disk_slabs ) drop_slab( id - disk_slabs );
+
+          off_t pos = (off_t) ( id % disk_slabs ) * slab_size;
+          if( ::pwrite( fd, slab.data.data(), slab.data.size(), pos ) ==
+              (ssize_t) slab.data.size() )
+            slab.on_disk = true;
+          else
+            drop_slab( id );
+        }
+
+        slabs[next++].data.reserve( slab_size );
+
+        //----------------------------------------------------------------------
+        // Let the oldest resident slabs go from memory
+        //----------------------------------------------------------------------
+        std::vector<uint32_t> evict;
+        size_t                resident = 0;
+        for( slabs_t::reverse_iterator it = slabs.rbegin();
+             it != slabs.rend(); ++it )
+          if( it->second.resident && ++resident > mem_slabs )
+            evict.push_back( it->first );
+
+        for( size_t i = 0; i < evict.size(); ++i )
+        {
+          slab_t &slab = slabs[evict[i]];
+          if( !slab.on_disk )
+          {
+            drop_slab( evict[i] );
+            continue;
+          }
+          slab.resident = false;
+          std::string().swap( slab.data );
+        }
+      }
+
+      std::mutex          mutex;
+      index_t             index;
+      slabs_t             slabs;
+      size_t              slab_size;
+      size_t              mem_slabs;
+      size_t              disk_slabs;
+      uint32_t            ttl;       //!< seconds, zero for never stale
+      clock::time_point   epoch;
+      int                 fd;
+      uint32_t            next;
+      stats              *counters;
+  };
+}
+
+#endif /* __FUSECACHE_SLABSTORE_HPP__ */
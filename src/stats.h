@@ -0,0 +1,203 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2012-2013 by European Organization for Nuclear Research (CERN)
+// Author: Justin Salmon <jsalmon@cern.ch>
+//------------------------------------------------------------------------------
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with This program.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#ifndef __FUSECACHE_STATS_HPP__
+#define __FUSECACHE_STATS_HPP__
+
+#include <algorithm>
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <mutex>
+
+namespace fusecache
+{
+  //----------------------------------------------------------------------------
+  //! Counters describing what the cache layer has been doing
+  //----------------------------------------------------------------------------
+  struct stats
+  {
+    typedef std::atomic<uint64_t> counter_t;
+
+    counter_t reads;          //!< read requests from FUSE
+    counter_t hits;           //!< pages served fresh from the cache
+    counter_t misses;         //!< pages fetched from the backend
+    counter_t fetches;        //!< backend requests issued, hedges included
+    counter_t fetch_errors;   //!< backend requests which failed
+    counter_t hedges;         //!< duplicate requests issued after the delay
+    counter_t hedge_wins;     //!< hedged requests which answered first
+    counter_t timeouts;       //!< fetches abandoned at the deadline
+    counter_t stale_served;   //!< stale pages served instead of waiting
+    counter_t stripes;        //!< backend requests, not counting hedges
+    counter_t read_ahead;     //!< pages fetched ahead of sequential readers
+    counter_t small_files;    //!< whole small files packed into slabs
+    counter_t slab_hits;      //!< reads served from a packed small file
+    counter_t bulk_fetches;   //!< backend requests for several small files
+    counter_t prefetches;     //!< files fetched because they were predicted
+    counter_t prefetch_hits;  //!< predicted files which were then accessed
+    counter_t throttled;      //!< predictions dropped for lack of budget
+    counter_t rejected;       //!< fetched pages not admitted to the cache
+    counter_t passed_through; //!< pages served without entering the cache
+    counter_t peer_hits;      //!< pages fetched from a peer daemon
+    counter_t peer_errors;    //!< pages a peer failed to give us
+    counter_t peer_served;    //!< pages given to peer daemons
+    counter_t dirty_writes;   //!< writes kept while the backend was offline
+    counter_t synced_files;   //!< files uploaded after coming back online
+    counter_t sync_errors;    //!< files which failed to upload
+    counter_t sync_dirty;     //!< bytes of dirty pages uploaded
+    counter_t sync_bytes;     //!< bytes actually sent to upload them
+    counter_t sync_stale;     //!< deltas refused for another base version
+    counter_t verified_bytes; //!< bytes checked against their checksum
+    counter_t verify_nsec;    //!< nanoseconds spent checking them
+    counter_t corrupt;        //!< blocks dropped for a checksum mismatch
+    counter_t forgotten;      //!< inodes dropped after the kernel forgot them
+
+    stats()
+    {
+      counter_t *c[] = { &reads, &hits, &misses, &fetches, &fetch_errors,
+                         &hedges, &hedge_wins, &timeouts, &stale_served,
+                         &stripes, &read_ahead, &small_files, &slab_hits,
+                         &bulk_fetches, &prefetches, &prefetch_hits,
+                         &throttled, &rejected, &passed_through, &peer_hits,
+                         &peer_errors, &peer_served, &dirty_writes,
+                         &synced_files, &sync_errors, &sync_dirty,
+                         &sync_bytes, &sync_stale, &verified_bytes,
+                         &verify_nsec, &corrupt, &forgotten };
+      for( size_t i = 0; i < sizeof( c ) / sizeof( c[0] ); ++i ) *c[i] = 0;
+    }
+
+    //--------------------------------------------------------------------------
+    //! @return part / whole as a percentage, or zero if whole is zero
+    //--------------------------------------------------------------------------
+    static double percent( uint64_t part, uint64_t whole )
+    {
+      return whole ? 100.0 * part / whole : 0.0;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Write the counters in human readable form
+    //--------------------------------------------------------------------------
+    void dump( std::ostream &out ) const
+    {
+      out << "reads:        " << reads        << std::endl
+          << "hits:         " << hits         << std::endl
+          << "misses:       " << misses       << std::endl
+          << "fetches:      " << fetches      << std::endl
+          << "fetch errors: " << fetch_errors << std::endl
+          << "hedges:       " << hedges << " ("
+          << percent( hedges, misses ) << "% of misses, "
+          << hedge_wins << " won)" << std::endl
+          << "timeouts:     " << timeouts << " ("
+          << percent( timeouts, misses ) << "% of misses)" << std::endl
+          << "stale served: " << stale_served << std::endl
+          << "stripes:      " << stripes << std::endl
+          << "read ahead:   " << read_ahead << " pages" << std::endl
+          << "small files:  " << small_files << " packed, "
+          << slab_hits << " reads served, "
+          << bulk_fetches << " bulk fetches" << std::endl
+          << "prefetches:   " << prefetches << " ("
+          << percent( prefetch_hits, prefetches ) << "% hit, "
+          << throttled << " throttled)" << std::endl
+          << "admission:    " << rejected << " pages rejected, "
+          << passed_through << " passed through" << std::endl
+          << "peers:        " << peer_hits << " pages fetched ("
+          << peer_errors << " failed), " << peer_served << " served"
+          << std::endl
+          << "offline:      " << dirty_writes << " writes, "
+          << synced_files << " files synced (" << sync_errors
+          << " failed), " << sync_bytes << " of " << sync_dirty
+          << " dirty bytes sent, " << sync_stale << " stale deltas"
+          << std::endl
+          << "checksums:    " << verified_bytes << " bytes verified in "
+          << verify_nsec / 1000 << " us, " << corrupt << " corrupt blocks"
+          << std::endl
+          << "forgotten:    " << forgotten << " inodes" << std::endl;
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  //! Keeps a window of recent backend latencies so that we can tell what
+  //! "slow" means for this particular backend
+  //----------------------------------------------------------------------------
+  class latency_tracker
+  {
+    public:
+      typedef std::chrono::microseconds duration;
+
+      //------------------------------------------------------------------------
+      //! Constructor
+      //!
+      //! @param window number of most recent samples to keep
+      //------------------------------------------------------------------------
+      latency_tracker( size_t window = 512 ) : next( 0 )
+      {
+        samples.reserve( window );
+        this->window = window;
+      }
+
+      //------------------------------------------------------------------------
+      //! Record one sample
+      //------------------------------------------------------------------------
+      void record( duration latency )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        if( samples.size() < window )
+          samples.push_back( latency );
+        else
+          samples[next] = latency;
+        next = ( next + 1 ) % window;
+      }
+
+      //------------------------------------------------------------------------
+      //! @return number of samples in the window
+      //------------------------------------------------------------------------
+      size_t count()
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        return samples.size();
+      }
+
+      //------------------------------------------------------------------------
+      //! @param p fraction between 0 and 1
+      //! @return the p-th percentile of the window, or zero if it is empty
+      //------------------------------------------------------------------------
+      duration percentile( double p )
+      {
+        std::vector<duration> sorted;
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          sorted = samples;
+        }
+        if( sorted.empty() ) return duration::zero();
+
+        size_t n = std::min( sorted.size() - 1,
+                             static_cast<size_t>( p * sorted.size() ) );
+        std::nth_element( sorted.begin(), sorted.begin() + n, sorted.end() );
+        return sorted[n];
+      }
+
+    private:
+      std::mutex            mutex;
+      std::vector<duration> samples;
+      size_t                window;
+      size_t                next;
+  };
+}
+
+#endif /* __FUSECACHE_STATS_HPP__ */
@@ -0,0 +1,178 @@
+//------------------------------------------------------------------------------
+// Copyright (c) 2012-2013 by European Organization for Nuclear Research (CERN)
+// Author: Justin Salmon <jsalmon@cern.ch>
+//------------------------------------------------------------------------------
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with This program.  If not, see <http://www.gnu.org/licenses/>.
+//------------------------------------------------------------------------------
+
+#ifndef __FUSECACHE_THREADPOOL_HPP__
+#define __FUSECACHE_THREADPOOL_HPP__
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <vector>
+
+namespace fusecache
+{
+  //----------------------------------------------------------------------------
+  //! Fixed-size pool of worker threads which run backend requests on behalf
+  //! of the FUSE threads, so that a FUSE request never has to wait longer
+  //! than it wants to for a slow backend.
+  //!
+  //! Jobs someone is waiting for go before background jobs, and background
+  //! jobs may only occupy some of the workers, so that a burst of them can
+  //! never hold up a request behind it.
+  //----------------------------------------------------------------------------
+  class thread_pool
+  {
+    public:
+      //------------------------------------------------------------------------
+      //! Constructor. No threads are created until start() is called, because
+      //! FUSE may fork when daemonizing and threads do not survive a fork.
+      //------------------------------------------------------------------------
+      thread_pool() : limit( 0 ), busy( 0 ), stopping( false ) {};
+
+      //------------------------------------------------------------------------
+      //! Destructor. Waits for queued and running jobs to finish.
+      //------------------------------------------------------------------------
+      ~thread_pool()
+      {
+        stop();
+      }
+
+      //------------------------------------------------------------------------
+      //! Start the worker threads
+      //!
+      //! @param nthreads   number of workers to run
+      //! @param background most workers running background jobs at once,
+      //!                   zero for all of them
+      //------------------------------------------------------------------------
+      void start( size_t nthreads, size_t background = 0 )
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        if( !workers.empty() ) return;
+
+        stopping = false;
+        limit    = background ? background : nthreads;
+        for( size_t i = 0; i < nthreads; ++i )
+          workers.push_back( std::thread( &thread_pool::run, this ) );
+      }
+
+      //------------------------------------------------------------------------
+      //! Stop the worker threads once the queue has drained
+      //------------------------------------------------------------------------
+      void stop()
+      {
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          stopping = true;
+        }
+        cond.notify_all();
+
+        for( size_t i = 0; i < workers.size(); ++i )
+          workers[i].join();
+        workers.clear();
+      }
+
+      //------------------------------------------------------------------------
+      //! Queue a job. If the pool has not been started the job is run
+      //! synchronously in the calling thread.
+      //!
+      //! @param background true if nobody is waiting for the job
+      //------------------------------------------------------------------------
+      void submit( const std::function<void()> &job, bool background = false )
+      {
+        {
+          std::lock_guard<std::mutex> lock( mutex );
+          if( !workers.empty() )
+          {
+            ( background ? later : jobs ).push_back( job );
+            cond.notify_one();
+            return;
+          }
+        }
+        job();
+      }
+
+      //------------------------------------------------------------------------
+      //! @return number of jobs waiting for a worker
+      //------------------------------------------------------------------------
+      size_t queued()
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        return jobs.size() + later.size();
+      }
+
+    private:
+      //------------------------------------------------------------------------
+      //! Worker thread main loop
+      //------------------------------------------------------------------------
+      void run()
+      {
+        for( ;; )
+        {
+          std::function<void()> job;
+          bool                  background;
+          {
+            std::unique_lock<std::mutex> lock( mutex );
+            while( !ready() && !stopping )
+              cond.wait( lock );
+            if( !ready() ) return;
+
+            background = jobs.empty();
+            std::deque<std::function<void()>> &queue =
+              background ? later : jobs;
+            job = queue.front();
+            queue.pop_front();
+            if( background ) busy++;
+          }
+          job();
+
+          if( background )
+          {
+            {
+              std::lock_guard<std::mutex> lock( mutex );
+              busy--;
+            }
+            cond.notify_one();
+          }
+        }
+      }
+
+      //------------------------------------------------------------------------
+      //! @return true if there is a job a worker may start now. When
+      //!         stopping, background jobs are drained without the limit.
+      //!         Caller holds the lock.
+      //------------------------------------------------------------------------
+      bool ready() const
+      {
+        return !jobs.empty() ||
+               ( !later.empty() && ( busy < limit || stopping ) );
+      }
+
+      std::mutex                        mutex;
+      std::condition_variable           cond;
+      std::deque<std::function<void()>> jobs;
+      std::deque<std::function<void()>> later;    //!< background jobs
+      std::vector<std::thread>          workers;
+      size_t                            limit;    //!< background job limit
+      size_t                            busy;     //!< background jobs running
+      bool                              stopping;
+  };
+}
+
+#endif /* __FUSECACHE_THREADPOOL_HPP__ */
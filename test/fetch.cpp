@@ -0,0 +1,174 @@
+/*
+ * fetch.cpp
+ *
+ * Reads through the page cache: stripes and readahead, hedged requests to
+ * a second replica, timeouts, and what a read sees after a write-through,
+ * including one racing with a fetch.
+ */
+
+#include "testfs.h"
+
+//------------------------------------------------------------------------------
+//! Reads of any size and alignment, hedging and timeouts
+//------------------------------------------------------------------------------
+static void test_read()
+{
+  testfs fs;
+  fs.cfg.page_size = 4; fs.cfg.readahead = 0; fs.cfg.small_file_size = 0;
+  fs.cfg.read_timeout = 100; fs.cfg.hedge_percentile = 90;
+  fs.cfg.hedge_delay = 20;
+  mount_layer( fs );
+
+  std::string data = "hello world, this is content";
+  fs.set( data );
+  CHECK( read_at( 2, 10, 0 ) == "hello worl" );
+  CHECK( read_at( 2, 100, 0 ) == data );
+  CHECK( read_at( 2, 5, 3 ) == "lo wo" );
+
+  // the first replica is slow, the hedge to the second one answers
+  fs.slow_replica = 0; fs.delay_ms = 60;
+  CHECK( read_at( 3, 8, 0 ) == "hello wo" );
+  CHECK( fs.statistics.hedges > 0 );
+
+  fs.slow_replica = testfs::ALL; fs.delay_ms = 300;
+  read_at( 4, 8, 0 );
+  CHECK( last_err == ETIMEDOUT );
+  fs.slow_replica = -1;
+  settle( 300 );
+
+  // offline, cached pages are still served
+  fs.state = layer::OFFLINE;
+  read_at( 9, 4, 0 );
+  CHECK( last_err == EIO );
+  CHECK( read_at( 2, 6, 0 ) == "hello " );
+  layer::destroy( 0 );
+}
+
+//------------------------------------------------------------------------------
+//! Concurrent readers of a slow page share one hedge
+//------------------------------------------------------------------------------
+static void test_hedge_once()
+{
+  testfs fs;
+  fs.cfg.page_size = 4; fs.cfg.readahead = 0; fs.cfg.small_file_size = 0;
+  fs.cfg.hedge_percentile = 95; fs.cfg.hedge_delay = 20;
+  mount_layer( fs );
+  fs.set( "hello world, this is content" );
+  fs.slow_replica = 0; fs.delay_ms = 150;
+
+  std::vector<std::thread> readers;
+  for( int i = 0; i < 6; ++i )
+    readers.push_back( std::thread( []{ layer::read( 0, 3, 8, 0, 0 ); } ) );
+  for( size_t i = 0; i < readers.size(); ++i ) readers[i].join();
+  CHECK( fs.statistics.hedges == 1 );
+  layer::destroy( 0 );
+}
+
+//------------------------------------------------------------------------------
+//! Stripes and readahead reassemble the file exactly
+//------------------------------------------------------------------------------
+static void test_stripes()
+{
+  testfs fs;
+  fs.cfg.page_size = 4; fs.cfg.stripe_size = 16; fs.cfg.readahead = 16;
+  fs.cfg.small_file_size = 0;
+  mount_layer( fs );
+
+  std::string data;
+  for( int i = 0; i < 1000; ++i ) data += (char) ( 'a' + i % 26 );
+  fs.set( data );
+  CHECK( read_all( 2, 1100, 40 ) == data );
+  CHECK( read_at( 2, 5, 3 ) == data.substr( 3, 5 ) );
+  CHECK( read_at( 3, 200, 100 ) == data.substr( 100, 200 ) );
+  layer::destroy( 0 );
+}
+
+//------------------------------------------------------------------------------
+//! A page invalidated by a write-through is fetched again, once
+//------------------------------------------------------------------------------
+static void test_write_through()
+{
+  testfs fs;
+  fs.cfg.page_size = 16; fs.cfg.cache_pages = 4; fs.cfg.readahead = 0;
+  fs.cfg.small_file_size = 0; fs.cfg.prefetch_rate = 0;
+  fs.cfg.admission = fusecache::ADMIT_TINYLFU;
+  mount_layer( fs );
+  fs.set( std::string( 64, 'a' ) );
+
+  read_at( 2, 16, 0 );
+  for( int r = 0; r < 6; ++r )
+    for( int off = 16; off < 64; off += 16 ) read_at( 2, 16, off );
+  settle( 20 );
+
+  CHECK( write_at( 2, "b", 0 ) == 0 );
+  int calls = fs.calls;
+  for( int i = 0; i < 5; ++i )
+  {
+    CHECK( read_at( 2, 16, 0 ) == "b" + std::string( 15, 'a' ) );
+    settle( 5 );
+  }
+  CHECK( fs.calls - calls == 1 );
+  CHECK( fs.statistics.rejected == 0 );
+  layer::destroy( 0 );
+}
+
+//------------------------------------------------------------------------------
+//! A fetch answered with what was there before a write-through does not
+//! fill the cache with it
+//------------------------------------------------------------------------------
+static void test_write_race()
+{
+  testfs fs;
+  fs.cfg.page_size = 16; fs.cfg.readahead = 0; fs.cfg.small_file_size = 0;
+  fs.cfg.page_ttl = 0; fs.cfg.read_timeout = 0; fs.cfg.hedge_percentile = 0;
+  mount_layer( fs );
+  fs.set( std::string( 64, 'a' ) );
+
+  fs.slow_replica = testfs::ALL; fs.delay_ms = 100;
+  std::thread reader( []{ layer::read( 0, 2, 16, 0, 0 ); } );
+  settle( 30 );
+  write_at( 2, "b", 0 );
+  reader.join();
+  fs.slow_replica = -1;
+
+  CHECK( read_at( 2, 16, 0 ) == "b" + std::string( 15, 'a' ) );
+  CHECK( read_at( 2, 16, 0 ) == "b" + std::string( 15, 'a' ) );
+  layer::destroy( 0 );
+}
+
+//------------------------------------------------------------------------------
+//! Readers of the same pages at once, as with kernel readahead, fetch each
+//! page only once
+//------------------------------------------------------------------------------
+static void test_concurrent()
+{
+  testfs fs;
+  fs.cfg.page_size = 4; fs.cfg.stripe_size = 16; fs.cfg.readahead = 0;
+  fs.cfg.small_file_size = 0; fs.cfg.hedge_percentile = 0;
+  fs.cfg.workers = 16;
+  mount_layer( fs );
+  fs.set( std::string( 256, 'a' ) );
+  fs.slow_replica = testfs::ALL; fs.delay_ms = 50;
+
+  std::vector<std::thread> readers;
+  for( int i = 0; i < 8; ++i )
+    readers.push_back( std::thread( [i]
+                       { layer::read( 0, 2, 64 - 4 * i, 4 * i, 0 ); } ) );
+  for( size_t i = 0; i < readers.size(); ++i ) readers[i].join();
+  CHECK( fs.calls == (int) fs.statistics.stripes );
+  CHECK( fs.calls <= 8 );
+  CHECK( read_at( 2, 64, 0 ) == std::string( 64, 'a' ) );
+  CHECK( fs.calls <= 8 );
+  layer::destroy( 0 );
+}
+
+int main()
+{
+  test_read();
+  test_hedge_once();
+  test_stripes();
+  test_write_through();
+  test_write_race();
+  test_concurrent();
+  return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * inodes.cpp
+ *
+ * The inode table against a plain map: lookups and forgets in random
+ * order, through growing and shrinking, and the read streams and directory
+ * counts kept beside it.
+ */
+
+#include "testfs.h"
+
+//------------------------------------------------------------------------------
+//! Random lookups and forgets keep the same counts as a map
+//------------------------------------------------------------------------------
+static void test_counts()
+{
+  fusecache::inode_table         table;
+  std::map<fuse_ino_t, uint64_t> want;
+  unsigned                       seed = 1;
+
+  for( int round = 0; round < 3; ++round )
+  {
+    for( int i = 0; i < 200000; ++i )
+    {
+      seed = seed * 1103515245 + 12345;
+      fuse_ino_t ino = 2 + ( seed >> 8 ) % ( round == 1 ? 500 : 50000 );
+      uint64_t   n   = 1 + ( seed >> 4 ) % 3;
+      if( ( seed >> 2 ) % 3 )
+      {
+        table.lookup( ino, n );
+        want[ino] += n;
+        continue;
+      }
+
+      bool gone = want[ino] <= n;
+      CHECK( table.forget( ino, n ) == gone );
+      if( gone )
+        want.erase( ino );
+      else
+        want[ino] -= n;
+    }
+    CHECK( table.size() == want.size() );
+
+    for( std::map<fuse_ino_t, uint64_t>::iterator it = want.begin();
+         it != want.end(); ++it )
+    {
+      table.set_eof( it->first, it->first );
+      CHECK( table.eof( it->first ) == (off_t) it->first );
+    }
+  }
+
+  // drain it: every count comes back exactly once
+  for( std::map<fuse_ino_t, uint64_t>::iterator it = want.begin();
+       it != want.end(); ++it )
+  {
+    if( it->second > 1 ) CHECK( !table.forget( it->first, it->second - 1 ) );
+    CHECK( table.forget( it->first, 1 ) );
+  }
+  CHECK( table.size() == 0 );
+  CHECK( table.eof( 2 ) == -1 );
+}
+
+//------------------------------------------------------------------------------
+//! Sequential reads, directory listings, and what forget drops
+//------------------------------------------------------------------------------
+static void test_state()
+{
+  fusecache::inode_table table;
+  off_t                  eof;
+
+  CHECK( table.advance( 7, 0, 10, eof ) && eof == -1 );
+  CHECK( !table.advance( 7, 10, 10, eof ) );
+  CHECK( table.listed( 7 ) == 0 );
+
+  table.lookup( 7 );
+  table.set_eof( 7, 100 );
+  CHECK( table.advance( 7, 0, 10, eof ) && eof == 100 );
+  CHECK( table.advance( 7, 10, 10, eof ) );
+  CHECK( !table.advance( 7, 50, 10, eof ) );
+  CHECK( table.listed( 7 ) == 1 && table.listed( 7 ) == 2 );
+
+  CHECK( table.forget( 7, 1 ) );
+  table.lookup( 7 );
+  CHECK( table.eof( 7 ) == -1 );
+  CHECK( !table.advance( 7, 60, 10, eof ) );
+  CHECK( table.listed( 7 ) == 1 );
+
+  // the root is always there
+  CHECK( table.listed( FUSE_ROOT_ID ) == 1 );
+  CHECK( table.size() == 2 );
+}
+
+int main()
+{
+  test_counts();
+  test_state();
+  return 0;
+}
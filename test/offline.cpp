@@ -0,0 +1,260 @@
+/*
+ * offline.cpp
+ *
+ * Writes and truncations made while the backend is offline: what reads see
+ * meanwhile, how they are uploaded once it is back, with and without
+ * write_delta(), and how they survive a restart.
+ */
+
+#include "testfs.h"
+
+//------------------------------------------------------------------------------
+//! Insert into a cached file offline and synchronize
+//------------------------------------------------------------------------------
+static void test_sync( int delta_ret )
+{
+  testfs fs;
+  fs.cfg.page_size = 16; fs.cfg.cache_pages = 4096; fs.cfg.readahead = 0;
+  fs.cfg.small_file_size = 0; fs.cfg.sync_interval = 0;
+  fs.delta_ret = delta_ret;
+  mount_layer( fs );
+  lookup( 2 );
+
+  std::string old = random_bytes( 4000, 7 );
+  fs.set( old );
+  CHECK( read_all( 2, 4100, 64 ) == old );
+
+  fs.state = layer::OFFLINE;
+  std::string edited = old.substr( 0, 100 ) + "XXXXX" + old.substr( 100 );
+  for( size_t off = 96; off < edited.size(); off += 50 )
+    CHECK( write_at( 2, edited.substr( off, 50 ), off ) == 0 );
+  CHECK( read_all( 2, 4100, 64 ) == edited );
+  CHECK( fs.get() == old );
+
+  fs.state = layer::ONLINE;
+  CHECK( fs.synchronize() == 0 );
+  CHECK( fs.get() == edited );
+  if( delta_ret == 0 ) CHECK( fs.statistics.sync_bytes < 500 );
+
+  // a partial write to a page never cached cannot be absorbed
+  fs.state = layer::OFFLINE;
+  CHECK( write_at( 3, "Z", 5 ) == EIO );
+  layer::destroy( 0 );
+}
+
+//------------------------------------------------------------------------------
+//! A delta encoded against a version the backend no longer holds is
+//! refused, and the pages are written whole instead
+//------------------------------------------------------------------------------
+static void test_sync_stale()
+{
+  testfs fs;
+  fs.cfg.page_size = 16; fs.cfg.cache_pages = 4096; fs.cfg.readahead = 0;
+  fs.cfg.small_file_size = 0; fs.cfg.sync_interval = 0;
+  mount_layer( fs );
+  lookup( 2 );
+
+  std::string old = random_bytes( 4000, 7 );
+  fs.set( old );
+  CHECK( read_all( 2, 4100, 64 ) == old );
+
+  fs.state = layer::OFFLINE;
+  std::string edited = old.substr( 0, 100 ) + "XXXXX" + old.substr( 100 );
+  CHECK( write_at( 2, edited.substr( 96 ), 96 ) == 0 );
+
+  // another writer changes a block the delta would copy from
+  std::string other = old;
+  other[2000] ^= 1;
+  fs.set( other );
+
+  fs.state = layer::ONLINE;
+  CHECK( fs.synchronize() == 0 );
+  CHECK( fs.statistics.sync_stale == 1 );
+  CHECK( fs.get() == edited );
+  layer::destroy( 0 );
+}
+
+//------------------------------------------------------------------------------
+//! Shrink and grow a file offline and synchronize
+//------------------------------------------------------------------------------
+static void test_truncate( int delta_ret )
+{
+  testfs fs;
+  fs.cfg.page_size = 16; fs.cfg.readahead = 0; fs.cfg.small_file_size = 0;
+  fs.cfg.sync_interval = 0;
+  fs.delta_ret = delta_ret;
+  mount_layer( fs );
+  lookup( 2 );
+
+  fs.set( std::string( 100, 'a' ) );
+  CHECK( read_at( 2, 100, 0 ) == std::string( 100, 'a' ) );
+
+  fs.state = layer::OFFLINE;
+  CHECK( write_at( 2, std::string( 20, 'B' ), 30 ) == 0 );
+  struct stat attr = {};
+  attr.st_size = 40;
+  layer::setattr( 0, 2, &attr, FUSE_SET_ATTR_SIZE, 0 );
+  std::string want = std::string( 30, 'a' ) + std::string( 10, 'B' );
+  CHECK( read_at( 2, 100, 0 ) == want );
+
+  CHECK( write_at( 2, "C", 44 ) == 0 );
+  want += std::string( 4, '\0' ) + "C";
+  CHECK( read_at( 2, 100, 0 ) == want );
+
+  fs.state = layer::ONLINE;
+  CHECK( fs.synchronize() == 0 );
+  CHECK( fs.get() == want );
+
+  // a truncation alone
+  fs.state = layer::OFFLINE;
+  attr.st_size = 5;
+  layer::setattr( 0, 2, &attr, FUSE_SET_ATTR_SIZE, 0 );
+  fs.state = layer::ONLINE;
+  CHECK( fs.synchronize() == 0 );
+  CHECK( fs.get() == "aaaaa" );
+  CHECK( fs.truncs == ( delta_ret ? 2 : 0 ) );
+  layer::destroy( 0 );
+}
+
+//------------------------------------------------------------------------------
+//! Truncations the filesystem refuses leave the file alone
+//------------------------------------------------------------------------------
+static void test_truncate_denied()
+{
+  testfs fs;
+  fs.cfg.page_size = 16; fs.cfg.readahead = 0; fs.cfg.small_file_size = 0;
+  fs.cfg.sync_interval = 0;
+  mount_layer( fs );
+  lookup( 2 );
+
+  std::string data = random_bytes( 100, 3 );
+  fs.set( data );
+  CHECK( read_at( 2, 100, 0 ) == data );
+
+  fs.state = layer::OFFLINE;
+  fs.deny = true;
+  fuse_file_info trunc = { O_RDWR | O_TRUNC, 0 };
+  layer::open( 0, 2, &trunc );
+  CHECK( last_err == EACCES );
+  struct stat attr = {};
+  attr.st_size = 10;
+  layer::setattr( 0, 2, &attr, FUSE_SET_ATTR_SIZE, 0 );
+  CHECK( last_err == EACCES );
+  CHECK( read_at( 2, 100, 0 ) == data );
+
+  fs.state = layer::ONLINE;
+  CHECK( fs.synchronize() == 0 );
+  CHECK( fs.get() == data && fs.truncs == 0 );
+
+  // the same open allowed
+  fs.state = layer::OFFLINE;
+  fs.deny = false;
+  layer::open( 0, 2, &trunc );
+  CHECK( last_err == 0 );
+  CHECK( read_at( 2, 100, 0 ) == "" );
+  layer::destroy( 0 );
+}
+
+//------------------------------------------------------------------------------
+//! Writes still dirty at unmount are uploaded after the next mount
+//------------------------------------------------------------------------------
+static void test_journal()
+{
+  std::string dir = scratch_dir();
+  std::string old( 64, 'a' );
+  {
+    testfs fs;
+    fs.cfg.page_size = 16; fs.cfg.readahead = 0; fs.cfg.small_file_size = 0;
+    fs.cfg.sync_interval = 20; fs.cfg.cache_dir = dir;
+    mount_layer( fs );
+    lookup( 2 );
+    fs.set( old );
+    CHECK( read_at( 2, 64, 0 ) == old );
+
+    // picked up by the watcher once the backend is back
+    fs.state = layer::OFFLINE;
+    CHECK( write_at( 2, "BB", 10 ) == 0 );
+    fs.state = layer::ONLINE;
+    settle( 300 );
+    CHECK( fs.get().substr( 10, 2 ) == "BB" );
+
+    fs.state = layer::OFFLINE;
+    CHECK( write_at( 2, "CC", 20 ) == 0 );
+    layer::destroy( 0 );
+    CHECK( access( ( dir + "/dirty" ).c_str(), F_OK ) == 0 );
+    old = fs.get();
+  }
+
+  testfs fs;
+  fs.cfg.page_size = 16; fs.cfg.readahead = 0; fs.cfg.small_file_size = 0;
+  fs.cfg.sync_interval = 20; fs.cfg.cache_dir = dir;
+  fs.set( old );
+  fs.state = layer::OFFLINE;
+  mount_layer( fs );
+  lookup( 2 );
+  CHECK( read_at( 2, 2, 20 ) == "CC" );
+  fs.state = layer::ONLINE;
+  settle( 300 );
+  CHECK( fs.get().substr( 20, 2 ) == "CC" );
+  layer::destroy( 0 );
+  CHECK( access( ( dir + "/dirty" ).c_str(), F_OK ) != 0 );
+  CHECK( system( ( "rm -rf " + dir ).c_str() ) == 0 );
+}
+
+//------------------------------------------------------------------------------
+//! Saved writes which are damaged, or belong to a file the inode no longer
+//! names, are dropped rather than uploaded
+//------------------------------------------------------------------------------
+static void test_journal_damaged( bool renumbered )
+{
+  std::string dir = scratch_dir();
+  std::string old( 64, 'a' );
+  {
+    testfs fs;
+    fs.cfg.page_size = 16; fs.cfg.readahead = 0; fs.cfg.small_file_size = 0;
+    fs.cfg.sync_interval = 0; fs.cfg.cache_dir = dir;
+    mount_layer( fs );
+    lookup( 2 );
+    fs.set( old );
+    CHECK( read_at( 2, 64, 0 ) == old );
+    fs.state = layer::OFFLINE;
+    CHECK( write_at( 2, "CC", 20 ) == 0 );
+    layer::destroy( 0 );
+  }
+
+  if( !renumbered )
+  {
+    std::string  path = dir + "/dirty";
+    std::fstream journal( path.c_str(), std::ios::in | std::ios::out |
+                                        std::ios::binary );
+    journal.seekp( -3, std::ios::end );
+    journal.put( 'Z' );
+  }
+
+  testfs fs;
+  fs.cfg.page_size = 16; fs.cfg.readahead = 0; fs.cfg.small_file_size = 0;
+  fs.cfg.sync_interval = 0; fs.cfg.cache_dir = dir;
+  fs.id_offset = renumbered ? 1 : 0;
+  fs.set( old );
+  mount_layer( fs );
+  lookup( 2 );
+  CHECK( read_at( 2, 4, 20 ) == "aaaa" );
+  CHECK( fs.synchronize() == 0 );
+  CHECK( fs.get() == old );
+  layer::destroy( 0 );
+  CHECK( system( ( "rm -rf " + dir ).c_str() ) == 0 );
+}
+
+int main()
+{
+  test_sync( 0 );
+  test_sync( -ENOSYS );
+  test_sync_stale();
+  test_truncate( 0 );
+  test_truncate( -ENOSYS );
+  test_truncate_denied();
+  test_journal();
+  test_journal_damaged( false );
+  test_journal_damaged( true );
+  return 0;
+}
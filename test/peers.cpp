@@ -0,0 +1,98 @@
+/*
+ * peers.cpp
+ *
+ * Daemons sharing pages over loopback. Three daemons own the pages of a
+ * file between them; a fourth which numbers the file differently reads it
+ * through them without going to the backend, until it writes to the file.
+ */
+
+#include "testfs.h"
+#include <sys/wait.h>
+
+static const int base_port = 17301;
+
+//------------------------------------------------------------------------------
+//! Configure a daemon as peer self, -1 for one which only asks
+//------------------------------------------------------------------------------
+static void setup( testfs &fs, int self, const std::string &data )
+{
+  fs.cfg.page_size = 16; fs.cfg.cache_pages = 1024; fs.cfg.readahead = 0;
+  fs.cfg.small_file_size = 0; fs.cfg.stripe_size = 128;
+  fs.cfg.peer_self = self;
+  for( int p = 0; p < 3; ++p )
+    fs.cfg.peers.push_back( "127.0.0.1:" + std::to_string( base_port + p ) );
+  fs.set( data );
+}
+
+//------------------------------------------------------------------------------
+//! Serve as peer self until the write end of stop is closed
+//------------------------------------------------------------------------------
+static pid_t serve( int self, const std::string &data, int stop[2] )
+{
+  pid_t pid = fork();
+  if( pid != 0 ) return pid;
+
+  testfs fs;
+  setup( fs, self, data );
+  mount_layer( fs );
+  close( stop[1] );
+  char c;
+  CHECK( ::read( stop[0], &c, 1 ) == 0 );
+  layer::destroy( 0 );
+  _exit( 0 );
+}
+
+//------------------------------------------------------------------------------
+//! Read the file as inode 102 through the peers, then write to it
+//------------------------------------------------------------------------------
+static void client( const std::string &data )
+{
+  testfs fs;
+  setup( fs, -1, data );
+  fs.id_offset = 100;
+  mount_layer( fs );
+
+  CHECK( read_all( 102, data.size() + 100, 64 ) == data );
+  CHECK( fs.calls == 0 );
+  CHECK( fs.statistics.peer_hits > 0 );
+
+  // the owners still have the old bytes; ours come from the backend
+  CHECK( write_at( 102, "XY", 0 ) == 0 );
+  CHECK( read_at( 102, 16, 0 ) == "XY" + data.substr( 2, 14 ) );
+  CHECK( fs.calls > 0 );
+  layer::destroy( 0 );
+}
+
+int main()
+{
+  std::string data;
+  for( int i = 0; i < 4000; ++i ) data += (char) ( 'a' + i % 26 );
+
+  int stop[2];
+  CHECK( pipe( stop ) == 0 );
+  pid_t owners[2] = { serve( 1, data, stop ), serve( 2, data, stop ) };
+  close( stop[0] );
+  settle( 200 );
+
+  testfs fs;
+  setup( fs, 0, data );
+  mount_layer( fs );
+  CHECK( read_all( 2, data.size() + 100, 64 ) == data );
+  CHECK( fs.statistics.peer_hits > 0 );
+
+  pid_t pid = fork();
+  if( pid == 0 )
+  {
+    close( stop[1] );
+    client( data );
+    _exit( 0 );
+  }
+
+  int status;
+  CHECK( waitpid( pid, &status, 0 ) == pid );
+  close( stop[1] );
+  for( int i = 0; i < 2; ++i ) waitpid( owners[i], 0, 0 );
+  layer::destroy( 0 );
+  CHECK( WIFEXITED( status ) && WEXITSTATUS( status ) == 0 );
+  return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * prefetch.cpp
+ *
+ * The successor model: what it predicts, and that a full model keeps
+ * learning by dropping the files it has not seen for longest, also across
+ * a restart.
+ */
+
+#include "testfs.h"
+
+//------------------------------------------------------------------------------
+//! @return the files predicted after a process goes from one file to another
+//------------------------------------------------------------------------------
+static std::vector<fuse_ino_t> after( fusecache::prefetcher &model,
+                                      pid_t                  pid,
+                                      fuse_ino_t             from,
+                                      fuse_ino_t             to )
+{
+  std::vector<fuse_ino_t> next;
+  model.observe( pid, from, next );
+  next.clear();
+  model.observe( pid, to, next );
+  return next;
+}
+
+//------------------------------------------------------------------------------
+//! Teach the model that file b follows file a
+//------------------------------------------------------------------------------
+static void teach( fusecache::prefetcher &model, fuse_ino_t a, fuse_ino_t b )
+{
+  for( int i = 0; i < 3; ++i ) after( model, 1, a, b );
+}
+
+//------------------------------------------------------------------------------
+//! A full model drops what it has not seen for longest to learn new files
+//------------------------------------------------------------------------------
+static void test_full()
+{
+  fusecache::prefetcher model;
+  model.configure( 16, 0.5, 0 );
+
+  teach( model, 10, 11 );
+  CHECK( after( model, 2, 20, 10 ) == std::vector<fuse_ino_t>( 1, 11 ) );
+
+  // fill the model with other files; the newest patterns are still learnt
+  for( fuse_ino_t ino = 100; ino < 200; ino += 2 ) teach( model, ino, ino + 1 );
+  CHECK( model.size() <= 16 );
+  CHECK( after( model, 2, 20, 198 ) == std::vector<fuse_ino_t>( 1, 199 ) );
+  CHECK( after( model, 2, 20, 10 ).empty() );
+
+  // a model saved larger than the capacity keeps the files seen last
+  std::string dir = scratch_dir();
+  CHECK( model.save( dir + "/successors" ) );
+  fusecache::prefetcher small;
+  small.configure( 4, 0.5, 0 );
+  small.load( dir + "/successors" );
+  CHECK( small.size() == 4 );
+  CHECK( after( small, 2, 20, 198 ) == std::vector<fuse_ino_t>( 1, 199 ) );
+  CHECK( system( ( "rm -rf " + dir ).c_str() ) == 0 );
+}
+
+int main()
+{
+  test_full();
+  return 0;
+}
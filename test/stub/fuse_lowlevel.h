@@ -0,0 +1,54 @@
+/*
+ * fuse_lowlevel.h
+ *
+ * The parts of the libfuse low level API which fusecache uses, so that the
+ * tests build and run without libfuse or a FUSE device. Replies are
+ * recorded by stubs.cpp rather than sent to the kernel.
+ */
+
+#ifndef __FUSECACHE_TEST_FUSE_LOWLEVEL_H__
+#define __FUSECACHE_TEST_FUSE_LOWLEVEL_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define FUSE_VERSION       29
+#define FUSE_ROOT_ID       1
+#define FUSE_SET_ATTR_SIZE ( 1 << 3 )
+
+typedef struct fuse_req *fuse_req_t;
+typedef unsigned long    fuse_ino_t;
+
+struct fuse_file_info   { int flags; uint64_t fh; };
+struct fuse_conn_info   { unsigned max_write; };
+struct fuse_forget_data { uint64_t ino; uint64_t nlookup; };
+struct fuse_ctx         { uid_t uid; gid_t gid; pid_t pid; };
+
+struct fuse_entry_param
+{
+  fuse_ino_t    ino;
+  unsigned long generation;
+  struct stat   attr;
+  double        attr_timeout;
+  double        entry_timeout;
+};
+
+int    fuse_reply_err( fuse_req_t req, int err );
+void   fuse_reply_none( fuse_req_t req );
+int    fuse_reply_buf( fuse_req_t req, const char *buf, size_t size );
+int    fuse_reply_attr( fuse_req_t req, const struct stat *attr,
+                        double timeout );
+int    fuse_reply_entry( fuse_req_t req, const struct fuse_entry_param *e );
+int    fuse_reply_create( fuse_req_t req, const struct fuse_entry_param *e,
+                          const struct fuse_file_info *fi );
+int    fuse_reply_open( fuse_req_t req, const struct fuse_file_info *fi );
+int    fuse_reply_write( fuse_req_t req, size_t count );
+size_t fuse_add_direntry( fuse_req_t req, char *buf, size_t bufsize,
+                          const char *name, const struct stat *stbuf,
+                          off_t off );
+const struct fuse_ctx *fuse_req_ctx( fuse_req_t req );
+
+#endif /* __FUSECACHE_TEST_FUSE_LOWLEVEL_H__ */
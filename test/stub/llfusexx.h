@@ -0,0 +1,31 @@
+/*
+ * llfusexx.h
+ *
+ * Stand-in for the llfusexx wrapper: daemonize() only records the
+ * filesystem object, and the tests call the static handlers themselves.
+ */
+
+#ifndef __FUSECACHE_TEST_LLFUSEXX_H__
+#define __FUSECACHE_TEST_LLFUSEXX_H__
+
+#include "fuse_lowlevel.h"
+
+namespace llfusexx
+{
+  template <typename T>
+  class fs
+  {
+    public:
+      static T *self;
+
+      int daemonize( int argc, char *argv[], T *s, void *userdata )
+      {
+        self = s;
+        return 0;
+      }
+  };
+
+  template <typename T> T *fs<T>::self = 0;
+}
+
+#endif /* __FUSECACHE_TEST_LLFUSEXX_H__ */
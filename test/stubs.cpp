@@ -0,0 +1,74 @@
+/*
+ * stubs.cpp
+ *
+ * Replies of the stand-in libfuse. The last reply made is kept in
+ * last_reply and last_err for the tests to look at.
+ */
+
+#include <fuse_lowlevel.h>
+#include <string>
+
+std::string last_reply;
+int         last_err = -1;
+
+static fuse_ctx ctx;
+
+int fuse_reply_err( fuse_req_t req, int err )
+{
+  last_err = err;
+  last_reply.clear();
+  return 0;
+}
+
+void fuse_reply_none( fuse_req_t req ) {}
+
+int fuse_reply_buf( fuse_req_t req, const char *buf, size_t size )
+{
+  last_err = 0;
+  last_reply.assign( buf ? buf : "", size );
+  return 0;
+}
+
+int fuse_reply_attr( fuse_req_t req, const struct stat *attr, double timeout )
+{
+  last_err = 0;
+  return 0;
+}
+
+int fuse_reply_entry( fuse_req_t req, const struct fuse_entry_param *e )
+{
+  last_err = 0;
+  return 0;
+}
+
+int fuse_reply_create( fuse_req_t                     req,
+                       const struct fuse_entry_param *e,
+                       const struct fuse_file_info   *fi )
+{
+  last_err = 0;
+  return 0;
+}
+
+int fuse_reply_open( fuse_req_t req, const struct fuse_file_info *fi )
+{
+  last_err = 0;
+  return 0;
+}
+
+int fuse_reply_write( fuse_req_t req, size_t count )
+{
+  last_err = 0;
+  return 0;
+}
+
+size_t fuse_add_direntry( fuse_req_t req, char *buf, size_t bufsize,
+                          const char *name, const struct stat *stbuf,
+                          off_t off )
+{
+  return 0;
+}
+
+const struct fuse_ctx *fuse_req_ctx( fuse_req_t req )
+{
+  return &ctx;
+}
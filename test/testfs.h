@@ -0,0 +1,321 @@
+/*
+ * testfs.h
+ *
+ * A filesystem kept in memory behind the fusecache layer, with knobs to
+ * make it slow, unreachable or lacking optional hooks, and the few helpers
+ * the tests share. The FUSE handlers are called directly; their replies
+ * end up in last_reply and last_err.
+ */
+
+#ifndef __FUSECACHE_TESTFS_H__
+#define __FUSECACHE_TESTFS_H__
+
+#include "fusecache.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+extern std::string last_reply;
+extern int         last_err;
+
+//------------------------------------------------------------------------------
+//! Fail the test with the condition and where it is
+//------------------------------------------------------------------------------
+#define CHECK( cond )                                                          \
+  do {                                                                         \
+    if( !( cond ) )                                                            \
+    {                                                                          \
+      fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,      \
+               #cond );                                                        \
+      exit( 1 );                                                               \
+    }                                                                          \
+  } while( 0 )
+
+//------------------------------------------------------------------------------
+//! Backend serving the same contents for every inode
+//------------------------------------------------------------------------------
+class testfs : public fusecache::fs<testfs>
+{
+  public:
+    testfs() : calls( 0 ), slow_replica( -1 ), delay_ms( 0 ), truncs( 0 ),
+               delta_ret( 0 ), id_offset( 0 ), deny( false ),
+               state( ONLINE ) {}
+
+    fusecache_status_t status()
+    {
+      return state;
+    }
+
+    int read( fuse_ino_t ino, size_t size, off_t off, std::string &buf )
+    {
+      return read_replica( ino, size, off, buf, 0 );
+    }
+
+    //--------------------------------------------------------------------------
+    //! Replica slow_replica, or every replica if it is ALL, takes delay_ms
+    //! to deliver what it read
+    //--------------------------------------------------------------------------
+    int read_replica( fuse_ino_t   ino,
+                      size_t       size,
+                      off_t        off,
+                      std::string &buf,
+                      int          replica )
+    {
+      calls++;
+      {
+        std::lock_guard<std::mutex> lock( mutex );
+        buf = off < (off_t) content.size() ? content.substr( off, size ) : "";
+      }
+      if( replica == slow_replica || slow_replica == ALL )
+        std::this_thread::sleep_for( std::chrono::milliseconds( delay_ms ) );
+      return 0;
+    }
+
+    int replicas()
+    {
+      return 2;
+    }
+
+    int write( fuse_ino_t ino, const std::string &buf, off_t off )
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      wrote[off] = buf;
+      put( buf, off );
+      return 0;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Applies the delta unless delta_ret says to fail, or it does not match
+    //! the contents
+    //--------------------------------------------------------------------------
+    int write_delta( fuse_ino_t                              ino,
+                     const std::vector<fusecache::delta_op> &ops )
+    {
+      typedef fusecache::delta_op op_t;
+      if( delta_ret ) return delta_ret;
+
+      std::lock_guard<std::mutex> lock( mutex );
+      std::string old = content;
+      for( size_t i = 0; i < ops.size(); ++i )
+      {
+        const op_t &op = ops[i];
+        off_t       at = op.type == op_t::COPY ? op.src : op.off;
+        if( op.type == op_t::LENGTH && op.off != (off_t) old.size() )
+          return -ESTALE;
+        if( ( op.type == op_t::COPY || op.type == op_t::VERIFY ) &&
+            ( at + op.len > old.size() ||
+              fusecache::strong_hash( old.data() + at, op.len ) != op.hash ) )
+          return -ESTALE;
+      }
+
+      delta = ops;
+      for( size_t i = 0; i < ops.size(); ++i )
+      {
+        const op_t &op = ops[i];
+        if( op.type == op_t::TRUNCATE )
+          content.resize( op.off );
+        else if( op.type == op_t::COPY )
+          put( old.substr( op.src, op.len ), op.off );
+        else if( op.type == op_t::DATA )
+          put( op.data, op.off );
+      }
+      return 0;
+    }
+
+    int truncate( fuse_ino_t ino, off_t size )
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      truncs++;
+      content.resize( size );
+      return 0;
+    }
+
+    //--------------------------------------------------------------------------
+    //! Peers know inode ino as ino - id_offset
+    //--------------------------------------------------------------------------
+    uint64_t file_id( fuse_ino_t ino )
+    {
+      return ino - id_offset;
+    }
+
+    fuse_ino_t file_inode( uint64_t id )
+    {
+      return id + id_offset;
+    }
+
+    //--------------------------------------------------------------------------
+    //! FUSE handlers
+    //--------------------------------------------------------------------------
+    static void open( fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi )
+    {
+      if( static_cast<testfs*>( self )->deny )
+        fuse_reply_err( req, EACCES );
+      else
+        reply_open( req, ino, fi );
+    }
+
+    static void setattr( fuse_req_t      req,
+                         fuse_ino_t      ino,
+                         struct stat    *attr,
+                         int             to_set,
+                         fuse_file_info *fi )
+    {
+      if( static_cast<testfs*>( self )->deny )
+        fuse_reply_err( req, EACCES );
+      else
+        reply_attr( req, ino, to_set, attr, 1.0 );
+    }
+
+    static void write( fuse_req_t      req,
+                       fuse_ino_t      ino,
+                       const char     *buf,
+                       size_t          size,
+                       off_t           off,
+                       fuse_file_info *fi )
+    {
+      self->write( ino, std::string( buf, size ), off );
+      fuse_reply_write( req, size );
+    }
+
+    static void init( void *userdata, fuse_conn_info *conn ) {}
+    static void destroy( void *userdata ) {}
+
+#define NOOP( name ) template <typename... A> static void name( A... ) {}
+    NOOP( getattr ) NOOP( lookup ) NOOP( readdir )
+    NOOP( releasedir ) NOOP( statfs ) NOOP( mknod ) NOOP( mkdir )
+    NOOP( unlink ) NOOP( rmdir ) NOOP( rename ) NOOP( access )
+    NOOP( opendir ) NOOP( release ) NOOP( fsync ) NOOP( forget )
+    NOOP( flush ) NOOP( getxattr ) NOOP( listxattr ) NOOP( removexattr )
+    NOOP( create ) NOOP( forget_multi )
+#undef NOOP
+
+    //--------------------------------------------------------------------------
+    //! Change what the backend holds
+    //--------------------------------------------------------------------------
+    void set( const std::string &data )
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      content = data;
+    }
+
+    std::string get()
+    {
+      std::lock_guard<std::mutex> lock( mutex );
+      return content;
+    }
+
+    static const int ALL = 99;
+
+    std::atomic<int>                  calls;
+    int                               slow_replica;
+    int                               delay_ms;
+    int                               truncs;
+    int                               delta_ret;
+    fuse_ino_t                        id_offset;
+    bool                              deny;
+    std::atomic<fusecache_status_t>   state;
+    std::map<off_t, std::string>      wrote;
+    std::vector<fusecache::delta_op>  delta;
+
+  private:
+    void put( const std::string &data, off_t off )
+    {
+      if( content.size() < off + data.size() )
+        content.resize( off + data.size() );
+      content.replace( off, data.size(), data );
+    }
+
+    std::mutex  mutex;
+    std::string content;
+};
+
+typedef fusecache::fs<testfs> layer;
+
+//------------------------------------------------------------------------------
+//! Mount fs: the layer starts as it would under FUSE
+//------------------------------------------------------------------------------
+inline void mount_layer( testfs &fs )
+{
+  fs.daemonize( 0, 0, &fs, 0 );
+  layer::init( 0, 0 );
+}
+
+//------------------------------------------------------------------------------
+//! Count a lookup of ino, as the kernel would before using it
+//------------------------------------------------------------------------------
+inline void lookup( fuse_ino_t ino )
+{
+  fuse_entry_param e = fuse_entry_param();
+  e.ino = ino;
+  layer::reply_entry( 0, &e );
+}
+
+//------------------------------------------------------------------------------
+//! @return size bytes of ino at off, read through the layer
+//------------------------------------------------------------------------------
+inline std::string read_at( fuse_ino_t ino, size_t size, off_t off )
+{
+  layer::read( 0, ino, size, off, 0 );
+  return last_reply;
+}
+
+//------------------------------------------------------------------------------
+//! @return all of ino up to size bytes, read through the layer in chunks
+//------------------------------------------------------------------------------
+inline std::string read_all( fuse_ino_t ino, size_t size, size_t chunk )
+{
+  std::string all;
+  for( size_t off = 0; off < size; off += chunk )
+    all += read_at( ino, chunk, off );
+  return all;
+}
+
+//------------------------------------------------------------------------------
+//! @return error of writing data to ino at off through the layer
+//------------------------------------------------------------------------------
+inline int write_at( fuse_ino_t ino, const std::string &data, off_t off )
+{
+  layer::write( 0, ino, data.data(), data.size(), off, 0 );
+  return last_err;
+}
+
+//------------------------------------------------------------------------------
+//! @return n pseudo random bytes
+//------------------------------------------------------------------------------
+inline std::string random_bytes( size_t n, unsigned seed )
+{
+  std::string s( n, '\0' );
+  for( size_t i = 0; i < n; ++i )
+  {
+    seed = seed * 1103515245 + 12345;
+    s[i] = (char) ( seed >> 16 );
+  }
+  return s;
+}
+
+//------------------------------------------------------------------------------
+//! @return a new empty directory for a cache
+//------------------------------------------------------------------------------
+inline std::string scratch_dir()
+{
+  char path[] = "/tmp/fusecache-test.XXXXXX";
+  CHECK( mkdtemp( path ) != 0 );
+  return path;
+}
+
+//------------------------------------------------------------------------------
+//! Sleep for ms milliseconds, to let background fetches finish
+//------------------------------------------------------------------------------
+inline void settle( int ms )
+{
+  std::this_thread::sleep_for( std::chrono::milliseconds( ms ) );
+}
+
+#endif /* __FUSECACHE_TESTFS_H__ */